@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+double
+bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int
+cmp_double(void const *a, void const *b)
+{
+  double x = *(double const *)a, y = *(double const *)b;
+
+  return (x > y) - (x < y);
+}
+
+BenchStats
+bench_stats(double *v, int n)
+{
+  BenchStats s = { 0 };
+
+  qsort(v, (size_t)n, sizeof(*v), cmp_double);
+  s.min = v[0];
+  s.max = v[n - 1];
+  s.median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+  for (int i = 0; i < n; i++)
+    s.mean += v[i] / n;
+  for (int i = 0; i < n; i++)
+    s.stddev += (v[i] - s.mean) * (v[i] - s.mean) / n;
+  s.stddev = sqrt(s.stddev);
+  return s;
+}
+
+void
+bench_print_stats(char const *key, BenchStats const *s, int prec)
+{
+  printf("\"%s\": {\"median\": %.*f, \"min\": %.*f, \"max\": %.*f, "
+         "\"mean\": %.*f, \"stddev\": %.*f}", key, prec, s->median, prec, s->min,
+         prec, s->max, prec, s->mean, prec, s->stddev);
+}
+
+int
+bench_parse_size(char const *s, size_t *out)
+{
+  char *end;
+  unsigned long long v;
+
+  errno = 0;
+  v = strtoull(s, &end, 10);
+  if (errno || end == s)
+    return -1;
+  switch (*end)
+  {
+    case 'G': v <<= 10; /* FALLTHROUGH */
+    case 'M': v <<= 10; /* FALLTHROUGH */
+    case 'K': v <<= 10; end++; break;
+  }
+  if (*end || v == 0)
+    return -1;
+  *out = (size_t)v;
+  return 0;
+}
+
+bool
+bench_listed(char const *list, char const *name)
+{
+  size_t len = strlen(name);
+
+  if (!list)
+    return true;
+  for (char const *p = list; p; p = strchr(p, ','), p = p ? p + 1 : NULL)
+    if (!strncmp(p, name, len) && (p[len] == ',' || p[len] == '\0'))
+      return true;
+  return false;
+}
@@ -0,0 +1,33 @@
+#ifndef __bench_h__
+#define __bench_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Helpers shared by the benchmark drivers: a monotonic clock, summary
+ * statistics over repetitions and the bits of command-line parsing that
+ * every driver needs.
+ */
+
+typedef struct BenchStats_s {
+  double median, min, max, mean, stddev;
+} BenchStats;
+
+/* Monotonic clock in nanoseconds. */
+double bench_now_ns(void);
+
+/* Summarizes v[0..n); sorts v in place. */
+BenchStats bench_stats(double *v, int n);
+
+/* Prints "key": {...} as a JSON member with prec digits after the point. */
+void bench_print_stats(char const *key, BenchStats const *s, int prec);
+
+/* Parses a positive count with an optional K, M or G suffix (powers of
+ * 1024); returns -1 if s is not one. */
+int bench_parse_size(char const *s, size_t *out);
+
+/* Is name in the comma-separated list (or is there no list)? */
+bool bench_listed(char const *list, char const *name);
+
+#endif /* !defined(__bench_h__) */
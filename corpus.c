@@ -0,0 +1,372 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+#define TEXT_WORDS 4096
+#define TEXT_LINE 72
+#define PAGE_SIZE 4096
+#define FILL_MAX_THREADS 64
+
+typedef void (*CorpusGen)(uint8_t *p, size_t n, size_t offset, uint64_t rng);
+
+typedef struct Corpus_s {
+  char const *name;
+  char const *desc;
+  CorpusGen gen;
+} Corpus;
+
+typedef struct CorpusFill_s {
+  Corpus const *c;
+  uint8_t *buf;
+  size_t n;
+  uint64_t seed;
+  atomic_size_t next;
+} CorpusFill;
+
+static once_flag tables_once = ONCE_FLAG_INIT;
+static char text_words[TEXT_WORDS][12];
+static uint8_t text_lens[TEXT_WORDS];
+static uint16_t text_zipf[65536];
+static uint8_t code_bytes[65536];
+
+static uint64_t
+splitmix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+static inline uint64_t
+next(uint64_t *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1d;
+}
+
+/* Spreads weights over a 64Ki-entry table so sampling is one lookup. */
+static void
+build_lut(uint8_t lut[65536], double const w[256])
+{
+  double total = 0.0, acc = 0.0;
+  size_t at = 0;
+
+  for (int b = 0; b < 256; b++)
+    total += w[b];
+  for (int b = 0; b < 256; b++)
+  {
+    acc += w[b];
+    size_t end = b == 255 ? 65536 : (size_t)(acc / total * 65536.0);
+    while (at < end)
+      lut[at++] = (uint8_t)b;
+  }
+}
+
+static void
+build_tables(void)
+{
+  /* English letter frequencies, in per mille. */
+  static char const letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+  static double const freq[] = {
+    127, 91, 82, 75, 70, 67, 63, 61, 60, 43, 40, 28, 28,
+    24, 24, 22, 20, 20, 19, 15, 10, 8, 2, 2, 1, 1,
+  };
+  double w[256] = { 0 };
+  uint8_t letter_lut[65536];
+  uint64_t rng = splitmix(1);
+
+  for (size_t i = 0; i < sizeof(freq) / sizeof(freq[0]); i++)
+    w[(uint8_t)letters[i]] = freq[i];
+  build_lut(letter_lut, w);
+
+  /* Short words are the common ones, as in real text. */
+  for (int i = 0; i < TEXT_WORDS; i++)
+  {
+    int len = 1 + (i >= 8) + (i >= 64) + (i >= 256) + (int)(next(&rng) % (3 + i / 512));
+    len = len > 11 ? 11 : len;
+    for (int j = 0; j < len; j++)
+      text_words[i][j] = (char)letter_lut[next(&rng) & 0xffff];
+    text_lens[i] = (uint8_t)len;
+  }
+
+  /* Zipf's law over word rank. */
+  double total = 0.0, acc = 0.0;
+  size_t at = 0;
+  for (int i = 0; i < TEXT_WORDS; i++)
+    total += 1.0 / (i + 1);
+  for (int i = 0; i < TEXT_WORDS; i++)
+  {
+    acc += 1.0 / (i + 1);
+    size_t end = i == TEXT_WORDS - 1 ? 65536 : (size_t)(acc / total * 65536.0);
+    while (at < end)
+      text_zipf[at++] = (uint16_t)i;
+  }
+
+  /* x86-64 code: REX.W, mov/lea/call/jcc opcodes, ModRM bytes and small
+   * or zero immediates dominate; everything else tails off. */
+  static uint8_t const hot[] = {
+    0x00, 0xff, 0x48, 0x89, 0x8b, 0x0f, 0xe8, 0x24, 0x44, 0x83,
+    0x85, 0x8d, 0x45, 0x4c, 0xc0, 0x74, 0x75, 0x01, 0x08, 0x10,
+    0xc3, 0xcc, 0x31, 0x39, 0x84, 0xeb, 0x41, 0x49, 0xe9, 0x5d,
+  };
+  static double const hot_w[] = {
+    180, 40, 45, 30, 28, 20, 16, 15, 14, 14,
+    10, 10, 10, 9, 8, 7, 7, 7, 6, 6,
+    5, 5, 5, 4, 4, 4, 4, 4, 3, 3,
+  };
+  for (int b = 0; b < 256; b++)
+    w[b] = 1.0 + 24.0 / (1 + (b < 128 ? b : 255 - b));
+  for (size_t i = 0; i < sizeof(hot); i++)
+    w[hot[i]] += hot_w[i];
+  build_lut(code_bytes, w);
+}
+
+static void
+gen_random(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  (void)offset;
+
+  for (; n >= 8; p += 8, n -= 8)
+  {
+    uint64_t x = next(&rng);
+    memcpy(p, &x, 8);
+  }
+  for (; n > 0; n--)
+    *p++ = (uint8_t)next(&rng);
+}
+
+static void
+gen_zero(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  (void)offset;
+  (void)rng;
+
+  memset(p, 0, n);
+}
+
+static void
+gen_text(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  uint8_t *end = p + n;
+  size_t col = 0;
+  bool capital = true;
+
+  (void)offset;
+
+  while (p < end)
+  {
+    uint64_t r = next(&rng);
+    int word = text_zipf[r & 0xffff];
+    size_t len = text_lens[word];
+
+    if ((size_t)(end - p) < len)
+      len = (size_t)(end - p);
+    memcpy(p, text_words[word], len);
+    if (capital && len > 0)
+      *p -= 'a' - 'A';
+    capital = false;
+    p += len;
+    col += len;
+
+    if (p == end)
+      break;
+    switch ((r >> 16) % 16)
+    {
+      case 0:
+        *p++ = '.';
+        capital = true;
+        break;
+      case 1:
+        *p++ = ',';
+        break;
+    }
+    if (p == end)
+      break;
+    if (col > TEXT_LINE) {
+      *p++ = '\n';
+      col = 0;
+    } else {
+      *p++ = ' ';
+      col++;
+    }
+  }
+}
+
+static void
+gen_code(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  uint8_t *end = p + n;
+
+  (void)offset;
+
+  while (p < end)
+  {
+    uint64_t r = next(&rng);
+
+    /* Padding and zero-extended imm32/disp32 fields. */
+    if ((r >> 60) == 0) {
+      size_t len = 1 + (r >> 32) % 16;
+      len = len < (size_t)(end - p) ? len : (size_t)(end - p);
+      memset(p, (r >> 56) & 1 ? 0xcc : 0x00, len);
+      p += len;
+      continue;
+    }
+    for (int i = 0; i < 3 && p < end; i++, r >>= 16)
+      *p++ = code_bytes[r & 0xffff];
+  }
+}
+
+/* 16-bit little-endian stereo-ish audio: two tones plus noise. The
+ * oscillators rotate by a fixed phasor, seeded from the absolute sample
+ * index so pieces join without a discontinuity. */
+static void
+gen_pcm(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  double const f1 = 440.0 / 44100.0, f2 = 3117.0 / 44100.0;
+  double t = (double)(offset / 2);
+  double c1 = cos(2 * M_PI * f1 * t), s1 = sin(2 * M_PI * f1 * t);
+  double c2 = cos(2 * M_PI * f2 * t), s2 = sin(2 * M_PI * f2 * t);
+  double const dc1 = cos(2 * M_PI * f1), ds1 = sin(2 * M_PI * f1);
+  double const dc2 = cos(2 * M_PI * f2), ds2 = sin(2 * M_PI * f2);
+
+  for (size_t i = 0; i < n; i += 2)
+  {
+    int noise = (int)(next(&rng) % 601) - 300;
+    int16_t v = (int16_t)(6000.0 * s1 + 2500.0 * s2 + noise);
+    double x;
+
+    p[i] = (uint8_t)v;
+    if (i + 1 < n)
+      p[i + 1] = (uint8_t)((uint16_t)v >> 8);
+
+    x = c1 * dc1 - s1 * ds1;
+    s1 = s1 * dc1 + c1 * ds1;
+    c1 = x;
+    x = c2 * dc2 - s2 * ds2;
+    s2 = s2 * dc2 + c2 * ds2;
+    c2 = x;
+  }
+}
+
+/* Database-style pages: most are empty, the rest hold a random header
+ * and a run of small-valued records before the free space. */
+static void
+gen_sparse(uint8_t *p, size_t n, size_t offset, uint64_t rng)
+{
+  (void)offset;
+
+  memset(p, 0, n);
+  for (size_t at = 0; at < n; at += PAGE_SIZE)
+  {
+    uint64_t r = next(&rng);
+    size_t room = n - at < PAGE_SIZE ? n - at : PAGE_SIZE;
+
+    if (r % 5 != 0)
+      continue;
+
+    size_t used = (r >> 8) % room;
+    for (size_t i = 0; i < used; i++)
+    {
+      if (i % 8 == 0)
+        r = next(&rng);
+      p[at + i] = i < 16 ? (uint8_t)r : (uint8_t)(r & 0x3f);
+      r >>= 8;
+    }
+  }
+}
+
+static Corpus const corpora[] = {
+  { "random", "uniform random bytes", gen_random },
+  { "zero", "all zero bytes", gen_zero },
+  { "text", "Zipf-distributed English-like words", gen_text },
+  { "code", "x86-64 machine code byte mix", gen_code },
+  { "pcm", "16-bit PCM audio, two tones plus noise", gen_pcm },
+  { "sparse", "4 KiB pages, mostly empty", gen_sparse },
+};
+
+#define N_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+size_t
+corpus_count(void)
+{
+  return N_CORPORA;
+}
+
+char const *
+corpus_name(size_t i)
+{
+  return i < N_CORPORA ? corpora[i].name : NULL;
+}
+
+char const *
+corpus_desc(size_t i)
+{
+  return i < N_CORPORA ? corpora[i].desc : NULL;
+}
+
+int
+corpus_find(char const *name)
+{
+  for (size_t i = 0; i < N_CORPORA; i++)
+    if (!strcmp(name, corpora[i].name))
+      return (int)i;
+  return -1;
+}
+
+static int
+fill_worker(void *arg)
+{
+  CorpusFill *f = arg;
+  size_t piece;
+
+  while ((piece = atomic_fetch_add(&f->next, 1)) * CORPUS_PIECE < f->n)
+  {
+    size_t at = piece * CORPUS_PIECE;
+    size_t len = f->n - at < CORPUS_PIECE ? f->n - at : CORPUS_PIECE;
+
+    f->c->gen(f->buf + at, len, at, splitmix(f->seed ^ splitmix(piece)));
+  }
+  return 0;
+}
+
+int
+corpus_fill(size_t i, void *buf, size_t n, uint64_t seed)
+{
+  CorpusFill f = { .buf = buf, .n = n, .seed = seed };
+  thrd_t threads[FILL_MAX_THREADS];
+  size_t n_pieces = (n + CORPUS_PIECE - 1) / CORPUS_PIECE;
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long started = 0;
+  int rc = 0;
+
+  if (i >= N_CORPORA)
+    return -1;
+  call_once(&tables_once, build_tables);
+  f.c = &corpora[i];
+
+  if (n_threads > FILL_MAX_THREADS)
+    n_threads = FILL_MAX_THREADS;
+  if ((size_t)n_threads > n_pieces / 4)
+    n_threads = (long)(n_pieces / 4);
+
+  atomic_init(&f.next, 0);
+  for (; started < n_threads; started++)
+    if (thrd_create(&threads[started], fill_worker, &f) != thrd_success) {
+      rc = -1;
+      break;
+    }
+
+  fill_worker(&f);
+  for (long t = 0; t < started; t++)
+    thrd_join(threads[t], NULL);
+
+  return rc;
+}
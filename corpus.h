@@ -0,0 +1,31 @@
+#ifndef __corpus_h__
+#define __corpus_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Synthetic benchmark inputs.
+ *
+ * Each corpus is a byte distribution meant to look like something we
+ * actually feed the tools: random, all-zero, text, machine code, PCM
+ * audio, sparse pages. Output depends only on (corpus, seed, offset):
+ * the buffer is generated in CORPUS_PIECE-sized pieces, each seeded
+ * from its index, so a prefix of a large corpus equals the small one
+ * and large fills can run on several threads.
+ */
+
+#define CORPUS_PIECE ((size_t)1 << 20)
+
+size_t corpus_count(void);
+char const *corpus_name(size_t i);
+char const *corpus_desc(size_t i);
+
+/* Index of the corpus called name, or -1. */
+int corpus_find(char const *name);
+
+/* Fills buf[0..n) with corpus i; returns -1 if i is out of range or a
+ * worker thread cannot be started. */
+int corpus_fill(size_t i, void *buf, size_t n, uint64_t seed);
+
+#endif /* !defined(__corpus_h__) */
@@ -1,30 +1,2660 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSSE3__
+#include <immintrin.h>
+#endif
+#include "hstat.h"
 
-static uint8_t byte_counts[256] = { 0 };
+/* Unit of work handed to the mmap workers. Large enough to amortize the
+ * atomic claim, small enough that all threads stay busy until the end. */
+#define CHUNK_SIZE ((size_t)16 << 20)
+
+#define MAX_THREADS 256
+
+/* Streams are read into a ring of slots of this size, one more than the
+ * counting threads can hold plus one being filled. */
+#define PIPE_SLOT_SIZE ((size_t)4 << 20)
+#define PIPE_MAX_SLOTS (MAX_THREADS + 2)
+
+/* Files up to this size are read() whole instead of mapped and chunked. */
+#define SMALL_FILE_MAX ((size_t)1 << 20)
+
+/* Largest bigram stride. Read buffers keep this much headroom in front of
+ * the data for the tail of the previous read, so pairs that straddle two
+ * reads are still counted; it is a page so the data stays aligned. */
+#define PAIR_MAX_STRIDE ((size_t)4096)
+
+/* Entropy windows are tracked as a fixed-point sum of c*log2(c) over the
+ * window's counts. Integer adds and subtracts of the same table entries
+ * cancel exactly, so the sum never drifts however long the input; the
+ * window cap keeps that sum inside an int64_t. */
+#define ENTROPY_FRAC_BITS 24
+#define ENTROPY_MAX_WINDOW ((size_t)1 << 30)
+
+/*
+ * Bigram counts live in two uint16_t tables (128 KiB each, so they stay
+ * in L2 where a uint32_t/uint64_t table would not) that alternate between
+ * consecutive pairs; that halves the dependency chains on repeated pairs
+ * such as runs of zeros. A counter wrapping to zero carries 65536 into
+ * the wide table, which is only touched on those rare carries.
+ */
+typedef struct HsPairHist_s {
+  uint16_t narrow[2][65536];
+  uint64_t wide[65536];
+} HsPairHist;
+
+/* Longest record for per-column histograms. */
+#define COLUMN_MAX_LEN ((size_t)1 << 16)
+
+/* Records shorter than this are interleaved into one virtual record of
+ * at least this many columns, so a field that repeats in every record
+ * does not chain increments on one counter. */
+#define COLUMN_MIN_WIDTH 64
+
+/* Columns are counted in tiles of COLUMN_TILE narrow tables (32 KiB, L1)
+ * over blocks of up to COLUMN_BLOCK input bytes (L2), which are re-read
+ * once per tile. */
+#define COLUMN_TILE 64
+#define COLUMN_BLOCK ((size_t)256 << 10)
+
+/*
+ * Per-column histograms: one 256-entry table per byte offset in the
+ * record, offset-major so a column's counters are contiguous. A record
+ * adds at most one to each narrow uint16_t counter, so they are widened
+ * into the uint64_t table every 65535 records and the increments need no
+ * carry check. width is the record length times the interleave factor;
+ * columns fold back onto offset % record when merged.
+ */
+typedef struct HsColumns_s {
+  size_t width;
+  size_t pending;
+  uint16_t *narrow;
+  uint64_t *wide;
+} HsColumns;
+
+typedef struct HsEntropy_s {
+  FILE *out;
+  size_t window;
+  size_t step;
+  int64_t *xlogx;
+  uint8_t *ring;
+  uint32_t counts[256];
+  int64_t sum;
+  uint64_t pos;
+  size_t until_emit;
+} HsEntropy;
+
+typedef struct HsWorker_s {
+  _Alignas(64) HsHist hist;
+  HsPairHist *pairs;
+  HsColumns *columns;
+  HsEntropy *entropy;
+  struct HsMapping_s *map;
+  struct HsPipeline_s *pipe;
+  thrd_t thread;
+  bool running;
+  int rc;
+} HsWorker;
+
+typedef struct HsMapping_s {
+  uint8_t const *base;
+  size_t size;
+  size_t n_chunks;
+  atomic_size_t next_chunk;
+} HsMapping;
+
+typedef struct HsPipeline_s {
+  int fd;
+  mtx_t lock;
+  cnd_t filled;
+  cnd_t drained;
+  uint8_t *slots[PIPE_MAX_SLOTS];
+  size_t lens[PIPE_MAX_SLOTS];
+  size_t pre[PIPE_MAX_SLOTS];
+  uint64_t offs[PIPE_MAX_SLOTS];
+  uint8_t carry[PAIR_MAX_STRIDE];
+  unsigned free_slots[PIPE_MAX_SLOTS];
+  unsigned n_free;
+  unsigned full_slots[PIPE_MAX_SLOTS];
+  unsigned full_head;
+  unsigned n_full;
+  bool eof;
+  int rc;
+} HsPipeline;
+
+typedef struct HsFile_s {
+  char *path;
+  uint8_t const *base;
+  size_t size;
+  atomic_size_t chunks_left;
+  mtx_t lock;
+  HsHist hist;
+} HsFile;
+
+typedef enum HsTaskKind_e {
+  HS_TASK_PATH,
+  HS_TASK_CHUNK,
+} HsTaskKind;
+
+typedef struct HsTask_s {
+  HsTaskKind kind;
+  bool top_level;
+  char *path;
+  HsFile *file;
+  size_t chunk;
+} HsTask;
+
+typedef struct HsDeque_s {
+  mtx_t lock;
+  HsTask *tasks;
+  size_t head;
+  size_t tail;
+  size_t cap;
+} HsDeque;
+
+typedef struct HsScanWorker_s {
+  _Alignas(64) HsHist hist;
+  HsPairHist *pairs;
+  HsColumns *columns;
+  HsDeque deque;
+  struct HsPool_s *pool;
+  uint8_t *buf;
+  uint64_t rng;
+  thrd_t thread;
+  bool running;
+  int rc;
+} HsScanWorker;
+
+typedef struct HsPool_s {
+  HsScanWorker workers[MAX_THREADS];
+  unsigned n_workers;
+  atomic_size_t pending;
+  bool recurse;
+  bool per_file;
+  mtx_t out_lock;
+} HsPool;
+
+/* Approximate mode: strata sampled round-robin, and the fewest blocks a
+ * variance estimate is trusted from. */
+#define APPROX_STRATA 64
+#define APPROX_MIN_BLOCKS 32
+
+#define HS_INDEX_MAGIC "HSIDX\0\0\1"
+#define HS_INDEX_SUPER 1024
+
+/* On-disk index layout: the header, n_super + 1 superblock entries, then
+ * the block blobs. Native endianness; the index is a cache, not an
+ * interchange format. */
+typedef struct HsIndexHeader_s {
+  char magic[8];
+  uint64_t file_size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t block_size;
+  uint64_t n_blocks;
+  uint64_t n_super;
+} HsIndexHeader;
+
+typedef struct HsIndexSuper_s {
+  uint64_t prefix[256];
+  uint64_t blob_offset;
+  uint64_t blob_size;
+} HsIndexSuper;
+
+typedef struct HsIndexBuilder_s {
+  HsIndexHeader hdr;
+  HsIndexSuper *supers;
+  uint8_t const *image;
+  atomic_size_t next_super;
+  mtx_t lock;
+  uint64_t end;
+  int fd;
+} HsIndexBuilder;
+
+typedef struct HsIndexWorker_s {
+  HsIndexBuilder *builder;
+  uint8_t *blob;
+  uint64_t sum[256];
+  thrd_t thread;
+  bool running;
+  int rc;
+} HsIndexWorker;
+
+typedef struct HsIndex_s {
+  void *base;
+  size_t size;
+  HsIndexHeader const *hdr;
+  HsIndexSuper const *supers;
+  int fd;
+} HsIndex;
+
+typedef struct HsApprox_s {
+  int fd;
+  uint64_t size;
+  size_t block_size;
+  uint64_t n_blocks;
+  uint64_t n_strata;
+  uint64_t max_per_stratum;
+  uint64_t mul[APPROX_STRATA];
+  uint64_t add[APPROX_STRATA];
+  double width;
+  double z;
+  uint64_t next_check;
+  atomic_uint_fast64_t next;
+  atomic_bool stop;
+  mtx_t lock;             /* guards next_check and everything below */
+  cnd_t sampled;
+  unsigned n_running;
+  uint64_t n_sampled;
+  uint64_t sum_m;
+  uint64_t sum_mm;
+  uint64_t sum_x[256];
+  uint64_t sum_xx[256];
+  uint64_t sum_xm[256];
+  int rc;
+} HsApprox;
+
+/* Hexdump mode, in xxd's layout: "offset: 16 bytes as 8 groups  ascii".
+ * Input is counted and formatted a slice at a time so the bytes are
+ * still in cache for the second pass, and output leaves in batches of
+ * DUMP_LINES lines per write(). */
+#define DUMP_SLICE ((size_t)64 << 10)
+#define DUMP_READ ((size_t)1 << 20)
+#define DUMP_LINES 16384
+
+/* The output buffer is filled with line templates once; formatting a
+ * full line only overwrites its offset, hex and ascii fields. The offset
+ * column is kept as text and incremented in place. */
+typedef struct HsDump_s {
+  int fd;
+  char *out;
+  size_t n_lines;
+  size_t width;
+  size_t line_len;
+  char offset[16];
+  uint8_t tail[16];
+  size_t n_tail;
+} HsDump;
+
+static HsHist byte_hist = { 0 };
+
+/* Bigram mode: 0 when off, else the distance between the paired bytes. */
+static size_t pair_stride = 0;
+static uint64_t *pair_counts = NULL;
+
+/* Column mode: 0 when off, else the record length; the counts are
+ * [column_len][256]. */
+static size_t column_len = 0;
+static uint64_t *column_counts = NULL;
+
+/* Entropy mode: consumes the input in order, so it runs single-threaded. */
+static HsEntropy *entropy_state = NULL;
+
+
+static HsPairHist *
+pairs_new(void)
+{
+  HsPairHist *ph;
+
+  if (pair_stride == 0)
+    return NULL;
+  if (!(ph = calloc(1, sizeof(*ph))))
+    perror("calloc");
+  return ph;
+}
+
+#define PAIR_INC(ph, t, key) \
+  do { \
+    unsigned k_ = (key); \
+    if (!++(ph)->narrow[(t)][k_]) \
+      (ph)->wide[k_] += 65536; \
+  } while (0)
+
+/* Count the pairs (p[i], p[i + stride]) that lie entirely in p[0..n). */
+static void
+pairs_count(HsPairHist *ph, uint8_t const *p, size_t n, size_t stride)
+{
+  size_t i = 0;
+
+  if (n <= stride)
+    return;
+  n -= stride;
+
+  for (; i + 2 <= n; i += 2)
+  {
+    PAIR_INC(ph, 0, (unsigned)p[i] << 8 | p[i + stride]);
+    PAIR_INC(ph, 1, (unsigned)p[i + 1] << 8 | p[i + 1 + stride]);
+  }
+  if (i < n)
+    PAIR_INC(ph, 0, (unsigned)p[i] << 8 | p[i + stride]);
+}
+
+static int
+pairs_merge(uint64_t dst[65536], HsPairHist const *ph)
+{
+  bool overflow = false;
+
+  for (unsigned k = 0; k < 65536; k++)
+    overflow |= __builtin_add_overflow(dst[k],
+                                       ph->wide[k] + ph->narrow[0][k] + ph->narrow[1][k],
+                                       &dst[k]);
+
+  if (overflow)
+    fprintf(stderr, "bigram counter overflow\n");
+  return overflow ? -1 : 0;
+}
+
+/* Returns per-thread column counters, or NULL when column counting is
+ * off or on allocation failure. */
+static HsColumns *
+columns_new(void)
+{
+  HsColumns *cs;
+
+  if (column_len == 0)
+    return NULL;
+  if (!(cs = calloc(1, sizeof(*cs)))) {
+    perror("calloc");
+    return NULL;
+  }
+  cs->width = column_len < COLUMN_MIN_WIDTH
+    ? (COLUMN_MIN_WIDTH + column_len - 1) / column_len * column_len
+    : column_len;
+  cs->narrow = calloc(cs->width * 256, sizeof(*cs->narrow));
+  cs->wide = calloc(cs->width * 256, sizeof(*cs->wide));
+  if (!cs->narrow || !cs->wide) {
+    perror("calloc");
+    free(cs->narrow);
+    free(cs->wide);
+    free(cs);
+    return NULL;
+  }
+  return cs;
+}
+
+static void
+columns_free(HsColumns *cs)
+{
+  if (!cs)
+    return;
+  free(cs->narrow);
+  free(cs->wide);
+  free(cs);
+}
+
+static void
+columns_widen(HsColumns *cs, size_t n_rec)
+{
+  if (cs->pending + n_rec <= UINT16_MAX) {
+    cs->pending += n_rec;
+    return;
+  }
+  for (size_t k = 0; k < cs->width * 256; k++)
+    cs->wide[k] += cs->narrow[k];
+  memset(cs->narrow, 0, cs->width * 256 * sizeof(*cs->narrow));
+  cs->pending = n_rec;
+}
+
+/* Counts p[0..n), whose first byte is at offset off in its file. */
+static void
+columns_count(HsColumns *cs, uint8_t const *p, size_t n, uint64_t off)
+{
+  size_t const w = cs->width;
+  size_t col = (size_t)(off % w);
+
+  /* Up to the first record boundary. */
+  if (col != 0 && n > 0)
+    columns_widen(cs, 1);
+  for (; n > 0 && col != 0; p++, n--, col = col + 1 == w ? 0 : col + 1)
+    cs->narrow[col * 256 + *p]++;
+
+  size_t per_block = COLUMN_BLOCK / w > 0 ? COLUMN_BLOCK / w : 1;
+  while (n >= w)
+  {
+    size_t n_rec = n / w < per_block ? n / w : per_block;
+
+    columns_widen(cs, n_rec);
+    for (size_t c0 = 0; c0 < w; c0 += COLUMN_TILE)
+    {
+      size_t c1 = c0 + COLUMN_TILE < w ? c0 + COLUMN_TILE : w;
+
+      for (size_t r = 0; r < n_rec; r++)
+      {
+        uint8_t const *rec = p + r * w;
+        for (size_t c = c0; c < c1; c++)
+          cs->narrow[c * 256 + rec[c]]++;
+      }
+    }
+    p += n_rec * w;
+    n -= n_rec * w;
+  }
+
+  /* A short last record. */
+  if (n > 0)
+    columns_widen(cs, 1);
+  for (size_t c = 0; c < n; c++)
+    cs->narrow[c * 256 + p[c]]++;
+}
+
+static int
+columns_merge(uint64_t *dst, HsColumns const *cs)
+{
+  bool overflow = false;
+
+  for (size_t c = 0; c < cs->width; c++)
+  {
+    uint64_t *d = &dst[c % column_len * 256];
+    for (unsigned b = 0; b < 256; b++)
+      overflow |= __builtin_add_overflow(d[b], cs->wide[c * 256 + b] + cs->narrow[c * 256 + b],
+                                         &d[b]);
+  }
+
+  if (overflow)
+    fprintf(stderr, "column counter overflow\n");
+  return overflow ? -1 : 0;
+}
+
+/*
+ * Count p[0..n) into h and, in bigram mode, every pair lying entirely in
+ * p[-pre..n + post). Callers pass the tail of the previous buffer as pre,
+ * or the bytes past a chunk that are still mapped as post, so that each
+ * pair is counted exactly once whichever way the input was split.
+ */
+static int
+count_span(HsHist *h, HsPairHist *ph, HsColumns *cs, uint8_t const *p, size_t n,
+           uint64_t off, size_t pre, size_t post)
+{
+  if (ph)
+    pairs_count(ph, p - pre, pre + n + post, pair_stride);
+  if (cs)
+    columns_count(cs, p, n, off);
+  if (hs_update(h, p, n) == -1) {
+    perror("count");
+    return -1;
+  }
+  return 0;
+}
+
+/* Fold one worker's tables into the global result and release them. */
+static int
+merge_results(HsHist const *h, HsPairHist *ph, HsColumns *cs)
+{
+  int rc = hs_merge(&byte_hist, h);
+
+  if (rc == -1)
+    perror("merge");
+  if (ph) {
+    if (pairs_merge(pair_counts, ph) == -1)
+      rc = -1;
+    free(ph);
+  }
+  if (cs) {
+    if (columns_merge(column_counts, cs) == -1)
+      rc = -1;
+    columns_free(cs);
+  }
+
+  return rc;
+}
+
+/* The bytes after a chunk that its last pairs reach into. */
+static size_t
+pair_lookahead(size_t end, size_t size)
+{
+  return size - end < pair_stride ? size - end : pair_stride;
+}
+
+/*
+ * Entropy profile. xlogx[c] is c * log2(c) in fixed point; a byte entering
+ * or leaving the window adjusts the running sum by the difference of two
+ * neighbouring entries, and H = log2(window) - sum / window.
+ */
+static int
+entropy_init(HsEntropy *e, FILE *out, size_t window, size_t step)
+{
+  memset(e, 0, sizeof(*e));
+  e->out = out;
+  e->window = window;
+  e->step = step;
+
+  if (!(e->xlogx = malloc((window + 1) * sizeof(*e->xlogx)))
+      || (step < window && !(e->ring = malloc(window)))) {
+    perror("malloc");
+    free(e->xlogx);
+    return -1;
+  }
+
+  e->xlogx[0] = 0;
+  for (size_t c = 1; c <= window; c++)
+    e->xlogx[c] = llround((double)c * log2((double)c) * (double)(1 << ENTROPY_FRAC_BITS));
+
+  return 0;
+}
+
+static void
+entropy_reset(HsEntropy *e)
+{
+  memset(e->counts, 0, sizeof(e->counts));
+  e->sum = 0;
+  e->pos = 0;
+  e->until_emit = e->window;
+}
+
+static void
+entropy_free(HsEntropy *e)
+{
+  free(e->xlogx);
+  free(e->ring);
+}
+
+static void
+entropy_emit(HsEntropy const *e, uint64_t offset, int64_t sum)
+{
+  double h = log2((double)e->window)
+           - (double)sum / (double)(1 << ENTROPY_FRAC_BITS) / (double)e->window;
+
+  fprintf(e->out, "%"PRIu64"\t%.6f\n", offset, h < 0.0 ? 0.0 : h);
+}
+
+/* Windows that don't overlap don't need sliding: count each one with the
+ * histogram kernel and sum f(c) over its 256 bins. */
+static void
+entropy_feed_blocks(HsEntropy *e, uint8_t const *p, size_t n)
+{
+  while (n > 0)
+  {
+    uint64_t in_period = e->pos % e->step;
+    size_t take;
+
+    if (in_period >= e->window) {
+      take = e->step - in_period < n ? e->step - in_period : n;
+    } else {
+      take = e->window - in_period < n ? e->window - in_period : n;
+      hs_count_u32(e->counts, p, take);
+      if (in_period + take == e->window) {
+        int64_t sum = 0;
+        for (int b = 0; b < 256; b++)
+          sum += e->xlogx[e->counts[b]];
+        entropy_emit(e, e->pos + take - e->window, sum);
+        memset(e->counts, 0, sizeof(e->counts));
+      }
+    }
+
+    e->pos += take;
+    p += take;
+    n -= take;
+  }
+}
+
+static void
+entropy_feed(HsEntropy *e, uint8_t const *p, size_t n)
+{
+  if (e->step >= e->window) {
+    entropy_feed_blocks(e, p, n);
+    return;
+  }
+
+  int64_t const *xlogx = e->xlogx;
+  uint32_t *counts = e->counts;
+  uint8_t *ring = e->ring;
+  size_t at = e->pos % e->window;
+  int64_t sum = e->sum;
+
+  while (n > 0)
+  {
+    /* Run up to the next window boundary with no emit check inside. */
+    size_t run = e->until_emit < n ? e->until_emit : n;
+
+    /* Still filling the first window: nothing leaves yet. */
+    size_t fill = e->pos < e->window ? e->window - e->pos : 0;
+    if (fill > run)
+      fill = run;
+    for (size_t i = 0; i < fill; i++)
+    {
+      uint32_t c = ++counts[p[i]];
+      sum += xlogx[c] - xlogx[c - 1];
+      ring[at + i] = p[i];
+    }
+    at += fill;
+    if (at == e->window)
+      at = 0;
+
+    for (size_t i = fill; i < run; i++)
+    {
+      uint8_t in = p[i];
+      uint8_t out = ring[at];
+
+      /* The same byte entering and leaving changes nothing, which makes
+       * runs and sparse regions the cheapest inputs instead of the worst. */
+      if (in != out) {
+        uint32_t ci = ++counts[in];
+        uint32_t co = counts[out]--;
+        sum += (xlogx[ci] - xlogx[ci - 1]) - (xlogx[co] - xlogx[co - 1]);
+        ring[at] = in;
+      }
+      if (++at == e->window)
+        at = 0;
+    }
+
+    e->pos += run;
+    p += run;
+    n -= run;
+    if ((e->until_emit -= run) == 0) {
+      entropy_emit(e, e->pos - e->window, sum);
+      e->until_emit = e->step;
+    }
+  }
+
+  e->sum = sum;
+}
+
+static int
+map_worker(void *arg)
+{
+  HsWorker *w = arg;
+  HsMapping *map = w->map;
+  size_t chunk;
+
+  while ((chunk = atomic_fetch_add(&map->next_chunk, 1)) < map->n_chunks)
+  {
+    size_t off = chunk * CHUNK_SIZE;
+    size_t len = map->size - off < CHUNK_SIZE ? map->size - off : CHUNK_SIZE;
+
+    w->rc = count_span(&w->hist, w->pairs, w->columns, &map->base[off], len, off, 0,
+                       pair_lookahead(off + len, map->size));
+    if (w->rc == -1)
+      break;
+    if (w->entropy)
+      entropy_feed(w->entropy, &map->base[off], len);
+
+    /* Done with these pages; drop them from our mapping so files far
+     * larger than RAM don't pin the page cache through our RSS. */
+    madvise((void *)&map->base[off], len, MADV_DONTNEED);
+  }
+
+  return 0;
+}
+
+static int
+process_mapped(int fd, char const *name, struct stat const *st, unsigned n_threads)
+{
+  static HsWorker workers[MAX_THREADS];
+
+  if (st->st_size == 0)
+    return 0;
+
+  HsMapping map = {
+    .size = (size_t)st->st_size,
+    .n_chunks = ((size_t)st->st_size + CHUNK_SIZE - 1) / CHUNK_SIZE,
+  };
+  atomic_init(&map.next_chunk, 0);
+
+  void *base = mmap(NULL, map.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    perror(name);
+    return -1;
+  }
+  map.base = base;
+  madvise(base, map.size, MADV_SEQUENTIAL);
+
+  if (n_threads > map.n_chunks)
+    n_threads = map.n_chunks;
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    hs_init(&workers[i].hist);
+    workers[i].pairs = pairs_new();
+    workers[i].columns = columns_new();
+    workers[i].entropy = i == 0 ? entropy_state : NULL;
+    workers[i].map = &map;
+    workers[i].pipe = NULL;
+    workers[i].rc = (pair_stride && !workers[i].pairs)
+      || (column_len && !workers[i].columns) ? -1 : 0;
+    if (workers[i].rc == -1)
+      atomic_store(&map.next_chunk, map.n_chunks);
+
+    /* The calling thread always takes a share of the chunks itself. */
+    workers[i].running = i > 0
+      && thrd_create(&workers[i].thread, map_worker, &workers[i]) == thrd_success;
+  }
+
+  map_worker(&workers[0]);
+
+  for (unsigned i = 1; i < n_threads; i++)
+    if (workers[i].running)
+      thrd_join(workers[i].thread, NULL);
+
+  int rc = 0;
+  for (unsigned i = 0; i < n_threads; i++)
+    if (merge_results(&workers[i].hist, workers[i].pairs, workers[i].columns) == -1 || workers[i].rc == -1)
+      rc = -1;
+
+  munmap(base, map.size);
+  return rc;
+}
+
+static int
+pipe_reader(void *arg)
+{
+  HsPipeline *pl = arg;
+  bool done = false;
+  size_t n_carry = 0;
+  uint64_t offset = 0;
+
+  while (!done)
+  {
+    mtx_lock(&pl->lock);
+    while (pl->n_free == 0)
+      cnd_wait(&pl->drained, &pl->lock);
+    unsigned slot = pl->free_slots[--pl->n_free];
+    mtx_unlock(&pl->lock);
+
+    /* Fill the whole slot so consumers see few, large handoffs. The
+     * headroom in front gets the tail of the previous slot for pairs. */
+    uint8_t *buf = pl->slots[slot] + PAIR_MAX_STRIDE;
+    size_t len = 0;
+    if (n_carry > 0)
+      memcpy(buf - n_carry, pl->carry, n_carry);
+    while (len < PIPE_SLOT_SIZE)
+    {
+      ssize_t r = read(pl->fd, &buf[len], PIPE_SLOT_SIZE - len);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r == -1) {
+        perror("read");
+        pl->rc = -1;
+      }
+      if (r <= 0) {
+        done = true;
+        break;
+      }
+      len += (size_t)r;
+    }
+
+    size_t pre = n_carry;
+    if (pair_stride > 0) {
+      n_carry = pre + len < pair_stride ? pre + len : pair_stride;
+      memcpy(pl->carry, buf + len - n_carry, n_carry);
+    }
+
+    mtx_lock(&pl->lock);
+    if (len > 0) {
+      pl->lens[slot] = len;
+      pl->pre[slot] = pre;
+      pl->offs[slot] = offset;
+      offset += len;
+      pl->full_slots[(pl->full_head + pl->n_full++) % PIPE_MAX_SLOTS] = slot;
+    } else {
+      pl->free_slots[pl->n_free++] = slot;
+    }
+    pl->eof = done;
+    cnd_broadcast(&pl->filled);
+    mtx_unlock(&pl->lock);
+  }
+
+  return 0;
+}
+
+static int
+pipe_worker(void *arg)
+{
+  HsWorker *w = arg;
+  HsPipeline *pl = w->pipe;
+
+  mtx_lock(&pl->lock);
+  for (;;)
+  {
+    while (pl->n_full == 0 && !pl->eof)
+      cnd_wait(&pl->filled, &pl->lock);
+    if (pl->n_full == 0)
+      break;
+    /* FIFO, so a single consumer sees the stream in order. */
+    unsigned slot = pl->full_slots[pl->full_head];
+    pl->full_head = (pl->full_head + 1) % PIPE_MAX_SLOTS;
+    pl->n_full--;
+    mtx_unlock(&pl->lock);
+
+    int rc = count_span(&w->hist, w->pairs, w->columns, pl->slots[slot] + PAIR_MAX_STRIDE,
+                        pl->lens[slot], pl->offs[slot], pl->pre[slot], 0);
+    if (w->entropy)
+      entropy_feed(w->entropy, pl->slots[slot] + PAIR_MAX_STRIDE, pl->lens[slot]);
+
+    mtx_lock(&pl->lock);
+    pl->free_slots[pl->n_free++] = slot;
+    cnd_signal(&pl->drained);
+    if ((w->rc = rc) == -1)
+      break;
+  }
+  mtx_unlock(&pl->lock);
+
+  return 0;
+}
+
+/*
+ * Pipes and sockets can't be mapped. One thread read()s into large
+ * page-aligned slots while the counting threads drain the full ones, so
+ * waiting on the producer overlaps with counting.
+ */
+static int
+process_stream(int fd, char const *name, unsigned n_threads)
+{
+  static HsWorker workers[MAX_THREADS];
+  static HsPipeline pl;
+  thrd_t reader;
+  unsigned n_slots = n_threads + 2;
+  int rc = 0;
+
+#if defined(F_SETPIPE_SZ)
+  /* A bigger pipe lets the producer run further ahead of us; failing to
+   * grow it (not a pipe, or over the limit) is harmless. */
+  fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#endif
+
+  memset(&pl, 0, sizeof(pl));
+  pl.fd = fd;
+  if (mtx_init(&pl.lock, mtx_plain) != thrd_success
+      || cnd_init(&pl.filled) != thrd_success
+      || cnd_init(&pl.drained) != thrd_success) {
+    fprintf(stderr, "%s: failed to set up reader\n", name);
+    return -1;
+  }
+
+  for (unsigned i = 0; i < n_slots; i++)
+  {
+    if (!(pl.slots[i] = aligned_alloc(4096, PAIR_MAX_STRIDE + PIPE_SLOT_SIZE))) {
+      perror("aligned_alloc");
+      rc = -1;
+      goto out;
+    }
+    pl.free_slots[pl.n_free++] = i;
+  }
+
+  if (thrd_create(&reader, pipe_reader, &pl) != thrd_success) {
+    fprintf(stderr, "%s: failed to start reader\n", name);
+    rc = -1;
+    goto out;
+  }
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    hs_init(&workers[i].hist);
+    workers[i].pairs = pairs_new();
+    workers[i].columns = columns_new();
+    workers[i].entropy = i == 0 ? entropy_state : NULL;
+    workers[i].map = NULL;
+    workers[i].pipe = &pl;
+    workers[i].rc = (pair_stride && !workers[i].pairs)
+      || (column_len && !workers[i].columns) ? -1 : 0;
+    workers[i].running = !workers[i].rc && i > 0
+      && thrd_create(&workers[i].thread, pipe_worker, &workers[i]) == thrd_success;
+  }
+
+  if (!workers[0].rc)
+    pipe_worker(&workers[0]);
+
+  for (unsigned i = 1; i < n_threads; i++)
+    if (workers[i].running)
+      thrd_join(workers[i].thread, NULL);
+
+  /* A failed consumer stops draining; let the reader run dry. */
+  mtx_lock(&pl.lock);
+  while (!pl.eof)
+  {
+    for (; pl.n_full > 0; pl.n_full--, pl.full_head = (pl.full_head + 1) % PIPE_MAX_SLOTS)
+      pl.free_slots[pl.n_free++] = pl.full_slots[pl.full_head];
+    cnd_signal(&pl.drained);
+    cnd_wait(&pl.filled, &pl.lock);
+  }
+  mtx_unlock(&pl.lock);
+  thrd_join(reader, NULL);
+
+  rc = pl.rc;
+  for (unsigned i = 0; i < n_threads; i++)
+    if (merge_results(&workers[i].hist, workers[i].pairs, workers[i].columns) == -1 || workers[i].rc == -1)
+      rc = -1;
+
+out:
+  for (unsigned i = 0; i < n_slots; i++)
+    free(pl.slots[i]);
+  cnd_destroy(&pl.drained);
+  cnd_destroy(&pl.filled);
+  mtx_destroy(&pl.lock);
+  return rc;
+}
+
+static int
+process_fd(int fd, char const *name, unsigned n_threads)
+{
+  if (entropy_state)
+    entropy_reset(entropy_state);
+
+  struct stat st;
+
+  if (fstat(fd, &st) == -1) {
+    perror(name);
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode))
+    return process_mapped(fd, name, &st, n_threads);
+
+  return process_stream(fd, name, n_threads);
+}
+
+static void scan_run(HsScanWorker *w, HsTask const *t);
+
+/* Inputs one at a time and in order, for modes that need a single stream
+ * per input (the entropy profile). */
+static int
+process_sequential(int n_paths, char *paths[])
+{
+  int rc = 0;
+
+  for (int i = 0; i < n_paths; i++)
+  {
+    int fd = open(paths[i], O_RDONLY);
+
+    if (fd == -1) {
+      perror(paths[i]);
+      rc = -1;
+      continue;
+    }
+    if (entropy_state && n_paths > 1)
+      fprintf(entropy_state->out, "# %s\n", paths[i]);
+    if (process_fd(fd, paths[i], 1) == -1)
+      rc = -1;
+    close(fd);
+  }
+
+  return rc;
+}
+
+/*
+ * Path scanning. Every path argument, every directory entry and every
+ * chunk of a large file is a task on a work-stealing pool: workers push
+ * and pop at the tail of their own deque and steal from the head of
+ * others', so a directory walk fans out across threads and the chunks of
+ * one huge file are picked up by whoever is idle.
+ */
+static bool
+deque_push(HsDeque *dq, HsTask const *t)
+{
+  bool ok = true;
+
+  mtx_lock(&dq->lock);
+  if (dq->tail - dq->head == dq->cap) {
+    size_t cap = dq->cap ? dq->cap * 2 : 64;
+    HsTask *tasks = malloc(cap * sizeof(*tasks));
+
+    if (tasks) {
+      for (size_t i = dq->head; i < dq->tail; i++)
+        tasks[i - dq->head] = dq->tasks[i % dq->cap];
+      free(dq->tasks);
+      dq->tasks = tasks;
+      dq->tail -= dq->head;
+      dq->head = 0;
+      dq->cap = cap;
+    } else {
+      ok = false;
+    }
+  }
+  if (ok) {
+    dq->tasks[dq->tail % dq->cap] = *t;
+    dq->tail++;
+  }
+  mtx_unlock(&dq->lock);
+
+  return ok;
+}
+
+static bool
+deque_pop(HsDeque *dq, HsTask *t)
+{
+  bool ok = false;
+
+  mtx_lock(&dq->lock);
+  if (dq->tail != dq->head) {
+    dq->tail--;
+    *t = dq->tasks[dq->tail % dq->cap];
+    ok = true;
+  }
+  mtx_unlock(&dq->lock);
+
+  return ok;
+}
+
+static bool
+deque_steal(HsDeque *dq, HsTask *t)
+{
+  bool ok = false;
+
+  mtx_lock(&dq->lock);
+  if (dq->tail != dq->head) {
+    *t = dq->tasks[dq->head % dq->cap];
+    dq->head++;
+    ok = true;
+  }
+  mtx_unlock(&dq->lock);
+
+  return ok;
+}
+
+static void
+scan_push(HsScanWorker *w, HsTask const *t)
+{
+  atomic_fetch_add(&w->pool->pending, 1);
+  if (!deque_push(&w->deque, t)) {
+    /* Out of memory growing the deque; run it here instead. */
+    atomic_fetch_sub(&w->pool->pending, 1);
+    scan_run(w, t);
+  }
+}
+
+static void
+scan_file_done(HsScanWorker *w, HsFile *f)
+{
+  HsPool *pool = w->pool;
+
+  if (pool->per_file) {
+    mtx_lock(&pool->out_lock);
+    printf("%"PRIu64, f->hist.total);
+    for (int b = 0; b < 256; b++)
+      printf(" %"PRIu64, f->hist.counts[b]);
+    printf(" %s\n", f->path);
+    mtx_unlock(&pool->out_lock);
+  }
+
+  if (f->base)
+    munmap((void *)f->base, f->size);
+  mtx_destroy(&f->lock);
+  free(f->path);
+  free(f);
+}
+
+static void
+scan_count(HsScanWorker *w, HsFile *f, uint8_t const *p, size_t n, uint64_t off,
+           size_t pre, size_t post)
+{
+  HsHist h;
+
+  hs_init(&h);
+  if (count_span(&h, w->pairs, w->columns, p, n, off, pre, post) == -1 || hs_merge(&w->hist, &h) == -1)
+    w->rc = -1;
+
+  if (w->pool->per_file) {
+    mtx_lock(&f->lock);
+    if (hs_merge(&f->hist, &h) == -1)
+      w->rc = -1;
+    mtx_unlock(&f->lock);
+  }
+}
+
+static void
+scan_chunk(HsScanWorker *w, HsFile *f, size_t chunk)
+{
+  size_t off = chunk * CHUNK_SIZE;
+  size_t len = f->size - off < CHUNK_SIZE ? f->size - off : CHUNK_SIZE;
+
+  scan_count(w, f, &f->base[off], len, off, 0, pair_lookahead(off + len, f->size));
+  madvise((void *)&f->base[off], len, MADV_DONTNEED);
+
+  if (atomic_fetch_sub(&f->chunks_left, 1) == 1)
+    scan_file_done(w, f);
+}
+
+static void
+scan_dir(HsScanWorker *w, int fd, char const *path)
+{
+  DIR *dir = fdopendir(fd);
+  struct dirent *de;
+
+  if (!dir) {
+    perror(path);
+    close(fd);
+    w->rc = -1;
+    return;
+  }
+
+  while ((de = readdir(dir)))
+  {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    /* Don't follow links out of (or back into) the tree. */
+    if (de->d_type != DT_REG && de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+      continue;
+
+    size_t len = strlen(path) + strlen(de->d_name) + 2;
+    HsTask t = { .kind = HS_TASK_PATH, .path = malloc(len), .top_level = false };
+    if (!t.path) {
+      perror("malloc");
+      w->rc = -1;
+      break;
+    }
+    snprintf(t.path, len, "%s/%s", path, de->d_name);
+    scan_push(w, &t);
+  }
+
+  closedir(dir);
+}
+
+static void
+scan_path(HsScanWorker *w, char *path, bool top_level)
+{
+  int flags = O_RDONLY | (top_level ? 0 : O_NOFOLLOW);
+  int fd = open(path, flags);
+  struct stat st;
+  HsFile *f = NULL;
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    /* Links met during the walk are skipped, not errors. */
+    if (!(fd == -1 && errno == ELOOP)) {
+      perror(path);
+      w->rc = -1;
+    }
+    goto out;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if (w->pool->recurse) {
+      scan_dir(w, fd, path);
+      fd = -1;
+    } else {
+      fprintf(stderr, "%s: is a directory (use -r)\n", path);
+      w->rc = -1;
+    }
+    goto out;
+  }
+
+  if (!(f = calloc(1, sizeof(*f))) || mtx_init(&f->lock, mtx_plain) != thrd_success) {
+    perror("calloc");
+    free(f);
+    w->rc = -1;
+    goto out;
+  }
+  f->path = path;
+  path = NULL;
+
+  if (S_ISREG(st.st_mode) && (size_t)st.st_size > SMALL_FILE_MAX) {
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      perror(f->path);
+      w->rc = -1;
+      scan_file_done(w, f);
+      goto out;
+    }
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    f->base = base;
+    f->size = (size_t)st.st_size;
+
+    /* Queue all but the first chunk for thieves and count that one now. */
+    size_t n_chunks = (f->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    atomic_init(&f->chunks_left, n_chunks);
+    for (size_t i = n_chunks - 1; i > 0; i--)
+    {
+      HsTask t = { .kind = HS_TASK_CHUNK, .file = f, .chunk = i };
+      scan_push(w, &t);
+    }
+    scan_chunk(w, f, 0);
+    goto out;
+  }
+
+  /* Small files and anything unmappable: plain reads, no mmap churn. */
+  uint8_t *buf = w->buf + PAIR_MAX_STRIDE;
+  size_t pre = 0;
+  uint64_t off = 0;
+  for (;;)
+  {
+    ssize_t r = read(fd, buf, SMALL_FILE_MAX);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1) {
+      perror(f->path);
+      w->rc = -1;
+    }
+    if (r <= 0)
+      break;
+    scan_count(w, f, buf, (size_t)r, off, pre, 0);
+    off += (uint64_t)r;
+
+    size_t keep = pre + (size_t)r < pair_stride ? pre + (size_t)r : pair_stride;
+    memmove(buf - keep, buf + r - keep, keep);
+    pre = keep;
+  }
+  scan_file_done(w, f);
+
+out:
+  if (fd != -1)
+    close(fd);
+  free(path);
+}
+
+static void
+scan_run(HsScanWorker *w, HsTask const *t)
+{
+  switch (t->kind)
+  {
+    case HS_TASK_PATH:
+      scan_path(w, t->path, t->top_level);
+      break;
+
+    case HS_TASK_CHUNK:
+      scan_chunk(w, t->file, t->chunk);
+      break;
+  }
+}
+
+static int
+scan_worker(void *arg)
+{
+  HsScanWorker *w = arg;
+  HsPool *pool = w->pool;
+  unsigned idle = 0;
+  HsTask t;
+
+  for (;;)
+  {
+    bool found = deque_pop(&w->deque, &t);
+
+    /* Steal from a random victim onwards so thieves don't pile up. */
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    for (unsigned i = 0; !found && i < pool->n_workers; i++)
+    {
+      HsScanWorker *victim = &pool->workers[(w->rng + i) % pool->n_workers];
+      found = victim != w && deque_steal(&victim->deque, &t);
+    }
+
+    if (found) {
+      scan_run(w, &t);
+      atomic_fetch_sub(&pool->pending, 1);
+      idle = 0;
+      continue;
+    }
+
+    if (atomic_load(&pool->pending) == 0)
+      break;
+    if (++idle < 64)
+      thrd_yield();
+    else
+      thrd_sleep(&(struct timespec){ .tv_nsec = 50000 }, NULL);
+  }
+
+  return 0;
+}
+
+static int
+process_paths(int n_paths, char *paths[], unsigned n_threads,
+              bool recurse, bool per_file)
+{
+  static HsPool pool;
+  int rc = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.n_workers = n_threads;
+  pool.recurse = recurse;
+  pool.per_file = per_file;
+  atomic_init(&pool.pending, 0);
+  mtx_init(&pool.out_lock, mtx_plain);
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    HsScanWorker *w = &pool.workers[i];
+    w->pool = &pool;
+    w->rng = 0x9e3779b97f4a7c15u * (i + 1);
+    hs_init(&w->hist);
+    mtx_init(&w->deque.lock, mtx_plain);
+    if (!(w->buf = aligned_alloc(4096, PAIR_MAX_STRIDE + SMALL_FILE_MAX))) {
+      perror("aligned_alloc");
+      return -1;
+    }
+    if (pair_stride && !(w->pairs = pairs_new()))
+      return -1;
+    if (column_len && !(w->columns = columns_new()))
+      return -1;
+  }
+
+  /* Deal the arguments out round-robin so every worker starts busy. */
+  for (int i = 0; i < n_paths; i++)
+  {
+    HsTask t = { .kind = HS_TASK_PATH, .path = strdup(paths[i]), .top_level = true };
+    if (!t.path) {
+      perror("strdup");
+      return -1;
+    }
+    scan_push(&pool.workers[i % n_threads], &t);
+  }
+
+  for (unsigned i = 1; i < n_threads; i++)
+    pool.workers[i].running =
+      thrd_create(&pool.workers[i].thread, scan_worker, &pool.workers[i]) == thrd_success;
+
+  scan_worker(&pool.workers[0]);
+
+  for (unsigned i = 1; i < n_threads; i++)
+    if (pool.workers[i].running)
+      thrd_join(pool.workers[i].thread, NULL);
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    HsScanWorker *w = &pool.workers[i];
+    if (merge_results(&w->hist, w->pairs, w->columns) == -1 || w->rc == -1)
+      rc = -1;
+    free(w->deque.tasks);
+    mtx_destroy(&w->deque.lock);
+    free(w->buf);
+  }
+  mtx_destroy(&pool.out_lock);
+
+  return rc;
+}
+
+/*
+ * Block index. One histogram per block, grouped into superblocks; each
+ * superblock stores the histogram of everything before it (the coarse
+ * prefix sum level) and a blob of its blocks' histograms, each one
+ * encoded bin by bin as the zigzag varint of its difference from the
+ * previous block. Neighbouring blocks of an image tend to look alike, so
+ * most deltas take a single byte.
+ *
+ * A range query takes the difference of two prefixes, each one a
+ * superblock entry plus at most HS_INDEX_SUPER - 1 decoded blocks, and
+ * counts the partial blocks at either edge from the image itself.
+ */
+static void
+index_put_varint(uint8_t **pp, int32_t d)
+{
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  uint8_t *p = *pp;
+
+  while (z >= 0x80)
+  {
+    *p++ = (uint8_t)(z | 0x80);
+    z >>= 7;
+  }
+  *p++ = (uint8_t)z;
+  *pp = p;
+}
+
+static int32_t
+index_get_varint(uint8_t const **pp)
+{
+  uint8_t const *p = *pp;
+  uint32_t z = 0;
+  int shift = 0;
+
+  while (*p & 0x80)
+  {
+    z |= (uint32_t)(*p++ & 0x7f) << shift;
+    shift += 7;
+  }
+  z |= (uint32_t)*p++ << shift;
+  *pp = p;
+
+  return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+static int
+index_build_worker(void *arg)
+{
+  HsIndexBuilder *ib = ((HsIndexWorker *)arg)->builder;
+  HsIndexWorker *w = arg;
+  size_t super;
+
+  while ((super = atomic_fetch_add(&ib->next_super, 1)) < ib->hdr.n_super)
+  {
+    uint64_t first = super * HS_INDEX_SUPER;
+    uint64_t last = first + HS_INDEX_SUPER < ib->hdr.n_blocks
+                  ? first + HS_INDEX_SUPER : ib->hdr.n_blocks;
+    uint32_t prev[256] = { 0 };
+    uint8_t *p = w->blob;
+
+    memset(w->sum, 0, sizeof(w->sum));
+    for (uint64_t b = first; b < last; b++)
+    {
+      uint64_t off = b * ib->hdr.block_size;
+      size_t len = ib->hdr.file_size - off < ib->hdr.block_size
+                 ? ib->hdr.file_size - off : ib->hdr.block_size;
+      uint32_t cur[256] = { 0 };
+
+      hs_count_u32(cur, &ib->image[off], len);
+      madvise((void *)&ib->image[off], len, MADV_DONTNEED);
+      for (int i = 0; i < 256; i++)
+      {
+        index_put_varint(&p, (int32_t)(cur[i] - prev[i]));
+        w->sum[i] += cur[i];
+        prev[i] = cur[i];
+      }
+    }
+
+    /* Blobs land in whatever order superblocks finish; the table keeps
+     * each one's offset. */
+    mtx_lock(&ib->lock);
+    HsIndexSuper *s = &ib->supers[super];
+    s->blob_offset = ib->end;
+    s->blob_size = (uint64_t)(p - w->blob);
+    memcpy(s->prefix, w->sum, sizeof(s->prefix));
+    ib->end += s->blob_size;
+    mtx_unlock(&ib->lock);
+
+    if (pwrite(ib->fd, w->blob, s->blob_size, (off_t)s->blob_offset) != (ssize_t)s->blob_size) {
+      perror("index write");
+      w->rc = -1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static int
+index_build(char const *index_path, char const *image_path,
+            size_t block_size, unsigned n_threads)
+{
+  static HsIndexWorker workers[MAX_THREADS];
+  static HsIndexBuilder ib;
+  struct stat st;
+  int fd = open(image_path, O_RDONLY);
+  int rc = 0;
+
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    if (fd != -1)
+      fprintf(stderr, "%s: not a regular file\n", image_path);
+    else
+      perror(image_path);
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+
+  memset(&ib, 0, sizeof(ib));
+  memcpy(ib.hdr.magic, HS_INDEX_MAGIC, sizeof(ib.hdr.magic));
+  ib.hdr.file_size = (uint64_t)st.st_size;
+  ib.hdr.mtime_sec = (uint64_t)st.st_mtim.tv_sec;
+  ib.hdr.mtime_nsec = (uint64_t)st.st_mtim.tv_nsec;
+  ib.hdr.block_size = block_size;
+  ib.hdr.n_blocks = (ib.hdr.file_size + block_size - 1) / block_size;
+  ib.hdr.n_super = (ib.hdr.n_blocks + HS_INDEX_SUPER - 1) / HS_INDEX_SUPER;
+  atomic_init(&ib.next_super, 0);
+  mtx_init(&ib.lock, mtx_plain);
+
+  /* One extra entry so the prefix at the end of the image is a lookup too. */
+  size_t table_size = (ib.hdr.n_super + 1) * sizeof(HsIndexSuper);
+  ib.end = sizeof(ib.hdr) + table_size;
+
+  if (!(ib.supers = calloc(ib.hdr.n_super + 1, sizeof(HsIndexSuper)))) {
+    perror("calloc");
+    close(fd);
+    return -1;
+  }
+
+  if (ib.hdr.file_size > 0) {
+    void *base = mmap(NULL, ib.hdr.file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      perror(image_path);
+      rc = -1;
+      goto out;
+    }
+    ib.image = base;
+    madvise(base, ib.hdr.file_size, MADV_SEQUENTIAL);
+  }
+
+  if ((ib.fd = open(index_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror(index_path);
+    rc = -1;
+    goto out;
+  }
+
+  if (n_threads > ib.hdr.n_super)
+    n_threads = ib.hdr.n_super ? (unsigned)ib.hdr.n_super : 1;
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    /* Worst case five bytes per bin per block. */
+    workers[i].blob = malloc((size_t)HS_INDEX_SUPER * 256 * 5);
+    workers[i].builder = &ib;
+    workers[i].rc = workers[i].blob ? 0 : -1;
+    if (workers[i].rc == -1) {
+      perror("malloc");
+      atomic_store(&ib.next_super, ib.hdr.n_super);
+    }
+    workers[i].running = i > 0 && !workers[i].rc
+      && thrd_create(&workers[i].thread, index_build_worker, &workers[i]) == thrd_success;
+  }
+
+  if (!workers[0].rc)
+    index_build_worker(&workers[0]);
+
+  for (unsigned i = 0; i < n_threads; i++)
+  {
+    if (workers[i].running)
+      thrd_join(workers[i].thread, NULL);
+    if (workers[i].rc == -1)
+      rc = -1;
+    free(workers[i].blob);
+  }
+
+  if (rc == 0) {
+    /* Turn per-superblock sums into prefixes, the last one being the
+     * histogram of the whole image. */
+    uint64_t run[256] = { 0 };
+    for (uint64_t s = 0; s <= ib.hdr.n_super; s++)
+    {
+      uint64_t sum[256];
+      memcpy(sum, ib.supers[s].prefix, sizeof(sum));
+      memcpy(ib.supers[s].prefix, run, sizeof(run));
+      for (int i = 0; i < 256; i++)
+        run[i] += sum[i];
+    }
+    ib.supers[ib.hdr.n_super].blob_offset = ib.end;
+
+    if (pwrite(ib.fd, &ib.hdr, sizeof(ib.hdr), 0) != (ssize_t)sizeof(ib.hdr)
+        || pwrite(ib.fd, ib.supers, table_size, sizeof(ib.hdr)) != (ssize_t)table_size) {
+      perror(index_path);
+      rc = -1;
+    }
+
+    HsHist *h = &byte_hist;
+    memcpy(h->counts, ib.supers[ib.hdr.n_super].prefix, sizeof(h->counts));
+    h->total = ib.hdr.file_size;
+  }
+
+  if (close(ib.fd) == -1) {
+    perror(index_path);
+    rc = -1;
+  }
+
+out:
+  if (ib.image)
+    munmap((void *)ib.image, ib.hdr.file_size);
+  free(ib.supers);
+  mtx_destroy(&ib.lock);
+  close(fd);
+  return rc;
+}
+
+static int
+index_open(HsIndex *ix, char const *index_path, char const *image_path)
+{
+  struct stat ist, st;
+  int ifd;
+
+  memset(ix, 0, sizeof(*ix));
+  ix->fd = open(image_path, O_RDONLY);
+  ifd = open(index_path, O_RDONLY);
+
+  if (ix->fd == -1 || fstat(ix->fd, &st) == -1) {
+    perror(image_path);
+    goto fail;
+  }
+  if (ifd == -1 || fstat(ifd, &ist) == -1) {
+    perror(index_path);
+    goto fail;
+  }
+  if ((size_t)ist.st_size < sizeof(HsIndexHeader)) {
+    fprintf(stderr, "%s: not an index\n", index_path);
+    goto fail;
+  }
+
+  void *base = mmap(NULL, (size_t)ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+  if (base == MAP_FAILED) {
+    perror(index_path);
+    goto fail;
+  }
+  ix->base = base;
+  ix->size = (size_t)ist.st_size;
+  ix->hdr = base;
+  ix->supers = (HsIndexSuper const *)(ix->hdr + 1);
+  close(ifd);
+  ifd = -1;
+
+  HsIndexHeader const *h = ix->hdr;
+  if (memcmp(h->magic, HS_INDEX_MAGIC, sizeof(h->magic))
+      || h->block_size == 0
+      || ix->size < sizeof(*h) + (h->n_super + 1) * sizeof(HsIndexSuper)
+      || ix->supers[h->n_super].blob_offset > ix->size) {
+    fprintf(stderr, "%s: not an index, or a corrupt one\n", index_path);
+    goto fail;
+  }
+  if (h->file_size != (uint64_t)st.st_size
+      || h->mtime_sec != (uint64_t)st.st_mtim.tv_sec
+      || h->mtime_nsec != (uint64_t)st.st_mtim.tv_nsec) {
+    fprintf(stderr, "%s: stale, %s changed since it was built\n", index_path, image_path);
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  if (ifd != -1)
+    close(ifd);
+  if (ix->base)
+    munmap(ix->base, ix->size);
+  if (ix->fd != -1)
+    close(ix->fd);
+  return -1;
+}
+
+static void
+index_close(HsIndex *ix)
+{
+  munmap(ix->base, ix->size);
+  close(ix->fd);
+}
+
+/* Histogram of blocks [0, block). */
+static void
+index_prefix(HsIndex const *ix, uint64_t block, uint64_t out[256])
+{
+  uint64_t super = block / HS_INDEX_SUPER;
+  uint64_t n = block % HS_INDEX_SUPER;
+  HsIndexSuper const *s = &ix->supers[super];
+  uint8_t const *p = (uint8_t const *)ix->base + s->blob_offset;
+  uint32_t cur[256] = { 0 };
+
+  memcpy(out, s->prefix, 256 * sizeof(*out));
+  for (uint64_t b = 0; b < n; b++)
+    for (int i = 0; i < 256; i++)
+    {
+      cur[i] += (uint32_t)index_get_varint(&p);
+      out[i] += cur[i];
+    }
+}
+
+/* Counts the edges with pread() rather than mapping the image: a query
+ * touches at most two blocks of it. */
+static int
+index_scan(HsIndex const *ix, uint64_t start, uint64_t end, HsHist *h)
+{
+  static uint8_t buf[1 << 16];
+
+  while (start < end)
+  {
+    size_t want = end - start < sizeof(buf) ? (size_t)(end - start) : sizeof(buf);
+    ssize_t r = pread(ix->fd, buf, want, (off_t)start);
+
+    if (r <= 0) {
+      perror("pread");
+      return -1;
+    }
+    if (hs_update(h, buf, (size_t)r) == -1) {
+      perror("count");
+      return -1;
+    }
+    start += (uint64_t)r;
+  }
+
+  return 0;
+}
+
+static int
+index_query(HsIndex const *ix, uint64_t start, uint64_t end, HsHist *h)
+{
+  uint64_t bs = ix->hdr->block_size;
+  uint64_t first = (start + bs - 1) / bs;
+  uint64_t last = end / bs;
+
+  if (end > ix->hdr->file_size)
+    end = ix->hdr->file_size;
+  if (start >= end)
+    return 0;
+
+  /* Not even one whole block inside the range: just count it. */
+  if (first >= last)
+    return index_scan(ix, start, end, h);
+
+  uint64_t lo[256];
+  uint64_t hi[256];
+  index_prefix(ix, first, lo);
+  index_prefix(ix, last, hi);
+  for (int i = 0; i < 256; i++)
+    h->counts[i] += hi[i] - lo[i];
+  h->total += (last - first) * bs;
+
+  if (index_scan(ix, start, first * bs, h) == -1
+      || index_scan(ix, last * bs, end, h) == -1)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Approximate mode. Blocks are drawn without replacement, round-robin
+ * over contiguous strata so that every region of the input is sampled
+ * early, and read with pread() by a pool of threads deep enough to keep
+ * the device queue full. Each bin's frequency is a ratio estimate over
+ * the sampled blocks; its bound comes from the between-block variance
+ * (cluster sampling, with finite population correction) and sampling
+ * stops once every bin's bound is within the requested width.
+ */
+static uint64_t
+gcd_u64(uint64_t a, uint64_t b)
+{
+  while (b)
+  {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static uint64_t
+approx_block_of(HsApprox const *ax, uint64_t k, bool *valid)
+{
+  uint64_t s = k % ax->n_strata;
+  uint64_t j = k / ax->n_strata;
+  uint64_t lo = s * ax->n_blocks / ax->n_strata;
+  uint64_t len = (s + 1) * ax->n_blocks / ax->n_strata - lo;
+
+  *valid = j < len;
+  if (!*valid)
+    return 0;
+
+  /* j -> (a*j + c) mod len is a permutation of the stratum for a coprime
+   * to len, which is all the randomness sampling without replacement
+   * needs. */
+  return lo + (uint64_t)(__extension__ ((unsigned __int128)ax->mul[s] * j + ax->add[s]) % len);
+}
+
+/* Estimates and half-widths from the sums; the widest half-width. Call
+ * with the lock held. */
+static double
+approx_bounds(HsApprox const *ax, double z, double p[256], double hw[256])
+{
+  double n = (double)ax->n_sampled;
+  double fpc = 1.0 - n / (double)ax->n_blocks;
+  double mbar = (double)ax->sum_m / n;
+  double widest = 0.0;
+
+  for (int b = 0; b < 256; b++)
+  {
+    p[b] = (double)ax->sum_x[b] / (double)ax->sum_m;
+
+    /* sum over blocks of (x_i - p m_i)^2, expanded */
+    double ss = (double)ax->sum_xx[b]
+              - 2.0 * p[b] * (double)ax->sum_xm[b]
+              + p[b] * p[b] * (double)ax->sum_mm;
+    double var = ss > 0.0 && n > 1.0 ? fpc * ss / (n * (n - 1.0) * mbar * mbar) : 0.0;
+
+    hw[b] = z * sqrt(var);
+    if (hw[b] > widest)
+      widest = hw[b];
+  }
+
+  return widest;
+}
+
+/* Stops every worker and fails the estimate. */
+static void
+approx_fail(HsApprox *ax)
+{
+  atomic_store(&ax->stop, true);
+  mtx_lock(&ax->lock);
+  ax->rc = -1;
+  mtx_unlock(&ax->lock);
+}
+
+static int
+approx_worker(void *arg)
+{
+  HsApprox *ax = arg;
+  uint8_t *buf = aligned_alloc(4096, ax->block_size);
+
+  if (!buf) {
+    perror("aligned_alloc");
+    approx_fail(ax);
+  }
+
+  while (buf && !atomic_load(&ax->stop))
+  {
+    uint64_t k = atomic_fetch_add(&ax->next, 1);
+    bool valid;
+
+    if (k >= ax->n_strata * ax->max_per_stratum)
+      break;
+    uint64_t block = approx_block_of(ax, k, &valid);
+    if (!valid)
+      continue;
+
+    uint64_t off = block * ax->block_size;
+    size_t want = ax->size - off < ax->block_size ? (size_t)(ax->size - off) : ax->block_size;
+    size_t got = 0;
+    while (got < want)
+    {
+      ssize_t r = pread(ax->fd, &buf[got], want - got, (off_t)(off + got));
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        perror("pread");
+        approx_fail(ax);
+        break;
+      }
+      got += (size_t)r;
+    }
+    if (got < want)
+      break;
+
+    uint32_t counts[256] = { 0 };
+    hs_count_u32(counts, buf, got);
+
+    mtx_lock(&ax->lock);
+    ax->n_sampled++;
+    ax->sum_m += got;
+    ax->sum_mm += (uint64_t)got * got;
+    for (int b = 0; b < 256; b++)
+    {
+      ax->sum_x[b] += counts[b];
+      ax->sum_xx[b] += (uint64_t)counts[b] * counts[b];
+      ax->sum_xm[b] += (uint64_t)counts[b] * got;
+    }
+
+    /* Checked by whichever thread crosses the next checkpoint rather than
+     * by a waiting thread, which would lag behind fast (cached) reads. */
+    if (ax->n_sampled >= ax->next_check) {
+      double p[256];
+      double hw[256];
+
+      ax->next_check = ax->n_sampled + (ax->n_sampled / 64 > 8 ? ax->n_sampled / 64 : 8);
+      if (approx_bounds(ax, ax->z, p, hw) <= ax->width)
+        atomic_store(&ax->stop, true);
+    }
+    mtx_unlock(&ax->lock);
+  }
+
+  mtx_lock(&ax->lock);
+  ax->n_running--;
+  cnd_signal(&ax->sampled);
+  mtx_unlock(&ax->lock);
+  free(buf);
+  return 0;
+}
+
+/* Two-sided normal quantile for the confidence level, by bisection. */
+static double
+approx_z(double confidence)
+{
+  double lo = 0.0;
+  double hi = 40.0;
+
+  for (int i = 0; i < 100; i++)
+  {
+    double mid = (lo + hi) / 2.0;
+    if (erfc(mid / sqrt(2.0)) > 1.0 - confidence)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return (lo + hi) / 2.0;
+}
+
+static int
+process_approx(char const *path, size_t block_size, double width,
+               double confidence, unsigned depth)
+{
+  static HsApprox ax;
+  thrd_t threads[MAX_THREADS];
+  double p[256];
+  double hw[256];
+  unsigned started = 0;
+
+  memset(&ax, 0, sizeof(ax));
+  ax.block_size = block_size;
+  ax.width = width;
+  ax.z = approx_z(confidence);
+  ax.next_check = APPROX_MIN_BLOCKS;
+  if ((ax.fd = open(path, O_RDONLY)) == -1) {
+    perror(path);
+    return -1;
+  }
+
+  /* Works for block devices too, where st_size is zero. */
+  off_t size = lseek(ax.fd, 0, SEEK_END);
+  if (size <= 0) {
+    if (size == -1)
+      perror(path);
+    else
+      fprintf(stderr, "%s: empty or not seekable\n", path);
+    close(ax.fd);
+    return -1;
+  }
+  posix_fadvise(ax.fd, 0, 0, POSIX_FADV_RANDOM);
+
+  ax.size = (uint64_t)size;
+  ax.n_blocks = (ax.size + block_size - 1) / block_size;
+  ax.n_strata = ax.n_blocks < APPROX_STRATA ? ax.n_blocks : APPROX_STRATA;
+  ax.max_per_stratum = (ax.n_blocks + ax.n_strata - 1) / ax.n_strata;
+
+  uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  for (uint64_t s = 0; s < ax.n_strata; s++)
+  {
+    uint64_t lo = s * ax.n_blocks / ax.n_strata;
+    uint64_t len = (s + 1) * ax.n_blocks / ax.n_strata - lo;
+
+    /* splitmix64 */
+    seed += 0x9e3779b97f4a7c15u;
+    uint64_t r = seed;
+    r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9u;
+    r = (r ^ (r >> 27)) * 0x94d049bb133111ebu;
+    r ^= r >> 31;
+
+    ax.add[s] = len ? r % len : 0;
+    ax.mul[s] = len ? (r >> 17) % len | 1 : 1;
+    while (len && gcd_u64(ax.mul[s], len) != 1)
+      ax.mul[s]++;
+  }
+
+  atomic_init(&ax.next, 0);
+  atomic_init(&ax.stop, false);
+  mtx_init(&ax.lock, mtx_plain);
+  cnd_init(&ax.sampled);
+
+  mtx_lock(&ax.lock);
+  for (unsigned i = 0; i < depth; i++)
+    if (thrd_create(&threads[started], approx_worker, &ax) == thrd_success)
+      started++;
+  ax.n_running = started;
+
+  while (ax.n_running > 0)
+    cnd_wait(&ax.sampled, &ax.lock);
+
+  if (ax.n_sampled > 0)
+    approx_bounds(&ax, ax.z, p, hw);
+  mtx_unlock(&ax.lock);
+
+  for (unsigned i = 0; i < started; i++)
+    thrd_join(threads[i], NULL);
+
+  if (ax.rc == 0 && ax.n_sampled > 0) {
+    printf("Hex Statistics (approximate: %"PRIu64" of %"PRIu64" blocks, %.4g%% confidence):\n",
+           ax.n_sampled, ax.n_blocks, confidence * 100.0);
+    for (int i = 0; i < 256; i++)
+      printf("\t[%d] : %.0f +/- %.0f (%.6f +/- %.6f)\n", i,
+             p[i] * (double)ax.size, hw[i] * (double)ax.size, p[i], hw[i]);
+  }
+
+  if (ax.n_sampled == 0)
+    fprintf(stderr, "%s: no blocks could be sampled\n", path);
+
+  cnd_destroy(&ax.sampled);
+  mtx_destroy(&ax.lock);
+  close(ax.fd);
+  return ax.n_sampled > 0 ? ax.rc : -1;
+}
 
 static void
-process(FILE *fp)
+dump_template(HsDump *d)
+{
+  d->line_len = d->width + 60;
+  for (size_t i = 0; i < DUMP_LINES; i++)
+  {
+    char *l = d->out + i * d->line_len;
+
+    memset(l, ' ', d->line_len - 1);
+    l[d->width] = ':';
+    l[d->line_len - 1] = '\n';
+  }
+}
+
+static int
+dump_write(int fd, char const *p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t w = write(fd, p, n);
+
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w == -1) {
+      perror("write");
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+static int
+dump_flush(HsDump *d)
+{
+  size_t n = d->n_lines * d->line_len;
+
+  d->n_lines = 0;
+  return dump_write(d->fd, d->out, n);
+}
+
+static int
+dump_init(HsDump *d, int fd)
+{
+  memset(d, 0, sizeof(*d));
+  if (!(d->out = malloc(DUMP_LINES * (sizeof(d->offset) + 60)))) {
+    perror("malloc");
+    return -1;
+  }
+  d->fd = fd;
+  d->width = 8;
+  memset(d->offset, '0', d->width);
+  dump_template(d);
+  return 0;
+}
+
+/* Steps the offset text to the next line. Full lines start at multiples
+ * of 16, so the last digit stays '0'. */
+static int
+dump_advance(HsDump *d)
+{
+  for (size_t i = d->width - 1; i-- > 0; )
+  {
+    char c = d->offset[i];
+
+    if (c != 'f') {
+      d->offset[i] = c == '9' ? 'a' : c + 1;
+      return 0;
+    }
+    d->offset[i] = '0';
+  }
+
+  /* Carried out of the column: widen it, as xxd does past 4 GiB. */
+  if (dump_flush(d) == -1)
+    return -1;
+  memmove(d->offset + 1, d->offset, d->width);
+  d->offset[0] = '1';
+  d->width++;
+  dump_template(d);
+  return 0;
+}
+
+static int
+dump_line(HsDump *d, uint8_t const *p)
+{
+  char *l = d->out + d->n_lines * d->line_len;
+  char *hex = l + d->width + 2;
+  char *ascii = hex + 41;
+
+  memcpy(l, d->offset, d->width);
+
+#ifdef __SSSE3__
+  /* Nibbles through a shuffle table give 32 hex digits in two vectors of
+   * four groups each; two overlapping stores per vector lay them out with
+   * the separating spaces. */
+  __m128i const digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                       '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  __m128i const nibble = _mm_set1_epi8(0x0f);
+  __m128i const head = _mm_setr_epi8(0, 1, 2, 3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12);
+  __m128i const head_sp = _mm_setr_epi8(0, 0, 0, 0, ' ', 0, 0, 0, 0, ' ', 0, 0, 0, 0, ' ', 0);
+  __m128i const rest = _mm_setr_epi8(3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12, 13, 14, 15);
+  __m128i const rest_sp = _mm_setr_epi8(0, ' ', 0, 0, 0, 0, ' ', 0, 0, 0, 0, ' ', 0, 0, 0, 0);
+  __m128i v = _mm_loadu_si128((__m128i const *)p);
+  __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+  __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+  __m128i a = _mm_unpacklo_epi8(hi, lo);
+  __m128i b = _mm_unpackhi_epi8(hi, lo);
+
+  _mm_storeu_si128((__m128i *)hex, _mm_or_si128(_mm_shuffle_epi8(a, head), head_sp));
+  _mm_storeu_si128((__m128i *)(hex + 3), _mm_or_si128(_mm_shuffle_epi8(a, rest), rest_sp));
+  _mm_storeu_si128((__m128i *)(hex + 20), _mm_or_si128(_mm_shuffle_epi8(b, head), head_sp));
+  _mm_storeu_si128((__m128i *)(hex + 23), _mm_or_si128(_mm_shuffle_epi8(b, rest), rest_sp));
+
+  /* Signed compares: bytes >= 0x80 are negative and fail the first. */
+  __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                                    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+  _mm_storeu_si128((__m128i *)ascii,
+                   _mm_or_si128(_mm_and_si128(printable, v),
+                                _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+#else
+  static char const digits[] = "0123456789abcdef";
+
+  for (int i = 0; i < 16; i++)
+  {
+    hex[i / 2 * 5 + i % 2 * 2] = digits[p[i] >> 4];
+    hex[i / 2 * 5 + i % 2 * 2 + 1] = digits[p[i] & 0x0f];
+    ascii[i] = p[i] >= 0x20 && p[i] < 0x7f ? (char)p[i] : '.';
+  }
+#endif
+
+  if (++d->n_lines == DUMP_LINES && dump_flush(d) == -1)
+    return -1;
+  return dump_advance(d);
+}
+
+static int
+dump_feed(HsDump *d, uint8_t const *p, size_t n)
+{
+  if (d->n_tail > 0) {
+    size_t take = 16 - d->n_tail < n ? 16 - d->n_tail : n;
+
+    memcpy(d->tail + d->n_tail, p, take);
+    d->n_tail += take;
+    p += take;
+    n -= take;
+    if (d->n_tail < 16)
+      return 0;
+    d->n_tail = 0;
+    if (dump_line(d, d->tail) == -1)
+      return -1;
+  }
+
+  for (; n >= 16; p += 16, n -= 16)
+    if (dump_line(d, p) == -1)
+      return -1;
+
+  memcpy(d->tail, p, n);
+  d->n_tail = n;
+  return 0;
+}
+
+/* Flushes the full lines, then the short last one: its ascii column
+ * stays aligned and ends after the bytes that are there. */
+static int
+dump_finish(HsDump *d)
+{
+  char line[sizeof(d->offset) + 60];
+  char *hex = line + d->width + 2;
+  size_t n = d->n_tail;
+  static char const digits[] = "0123456789abcdef";
+
+  if (dump_flush(d) == -1)
+    return -1;
+  if (n == 0)
+    return 0;
+
+  memset(line, ' ', sizeof(line));
+  memcpy(line, d->offset, d->width);
+  line[d->width] = ':';
+  for (size_t i = 0; i < n; i++)
+  {
+    uint8_t c = d->tail[i];
+
+    hex[i / 2 * 5 + i % 2 * 2] = digits[c >> 4];
+    hex[i / 2 * 5 + i % 2 * 2 + 1] = digits[c & 0x0f];
+    hex[41 + i] = c >= 0x20 && c < 0x7f ? (char)c : '.';
+  }
+  hex[41 + n] = '\n';
+  return dump_write(d->fd, line, (size_t)(hex + 42 + n - line));
+}
+
+/* Counts and formats alternate per slice, so the formatter reads what
+ * the histogram kernel just pulled into cache. */
+static int
+dump_data(HsDump *d, uint8_t const *p, size_t n)
+{
+  while (n > 0)
+  {
+    size_t len = n < DUMP_SLICE ? n : DUMP_SLICE;
+
+    if (hs_update(&byte_hist, p, len) == -1) {
+      perror("hexdump");
+      return -1;
+    }
+    if (dump_feed(d, p, len) == -1)
+      return -1;
+    p += len;
+    n -= len;
+  }
+  return 0;
+}
+
+static int
+dump_fd(HsDump *d, int fd, char const *name)
+{
+  struct stat st;
+  uint8_t *buf;
+  ssize_t got;
+  int rc = 0;
+
+  if (fstat(fd, &st) == -1) {
+    perror(name);
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+      rc = dump_data(d, map, (size_t)st.st_size);
+      munmap(map, (size_t)st.st_size);
+      return rc;
+    }
+  }
+
+  if (!(buf = malloc(DUMP_READ))) {
+    perror("malloc");
+    return -1;
+  }
+  while ((got = read(fd, buf, DUMP_READ)) != 0)
+  {
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == -1) {
+      perror(name);
+      rc = -1;
+      break;
+    }
+    if (dump_data(d, buf, (size_t)got) == -1) {
+      rc = -1;
+      break;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+/* Dumps the inputs back to back, as if concatenated, to dump_path ("-"
+ * for stdout). */
+static int
+run_dump(char const *dump_path, int n_paths, char *paths[])
 {
-  int c = -1;
+  bool to_stdout = !strcmp(dump_path, "-");
+  int out = to_stdout ? STDOUT_FILENO : open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  HsDump d;
+  int rc = 0;
+
+  if (out == -1) {
+    perror(dump_path);
+    return -1;
+  }
+  if (dump_init(&d, out) == -1) {
+    if (!to_stdout)
+      close(out);
+    return -1;
+  }
+
+  if (n_paths == 0)
+    rc = dump_fd(&d, STDIN_FILENO, "stdin");
+  for (int i = 0; i < n_paths && rc == 0; i++)
+  {
+    int fd = open(paths[i], O_RDONLY);
+
+    if (fd == -1) {
+      perror(paths[i]);
+      rc = -1;
+      break;
+    }
+    rc = dump_fd(&d, fd, paths[i]);
+    close(fd);
+  }
 
-  while ((c = getc(fp)) != -1)
-    byte_counts[c]++;
+  if (rc == 0)
+    rc = dump_finish(&d);
+  free(d.out);
+  if (!to_stdout && close(out) == -1) {
+    perror(dump_path);
+    rc = -1;
+  }
+  return rc;
 }
 
 static void
-print_stats(void)
+print_stats(FILE *out, HsHist const *h)
 {
-  printf("Hex Statistics:\n");
+  fprintf(out, "Hex Statistics:\n");
   for (int i = 0; i < 256; i++)
-    printf("\t[%d] : %"PRIu8"\n", i, byte_counts[i]);
+    fprintf(out, "\t[%d] : %"PRIu64"\n", i, h->counts[i]);
+}
+
+/*
+ * Count tables are written as native-endian uint64_t with no header. The
+ * bigram matrix is 256 x 256, row major by first byte: entry [a][b] counts
+ * a followed by b at the stride. The column table is record x 256, entry
+ * [c][b] counting byte b at offset c of a record. Either loads as e.g.
+ * np.fromfile(path, "<u8").reshape(-1, 256).
+ */
+static int
+write_counts(char const *path, uint64_t const *counts, size_t n)
+{
+  FILE *fp = fopen(path, "wb");
+  int rc = 0;
+
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  if (fwrite(counts, sizeof(*counts), n, fp) != n)
+    rc = -1;
+  if (fclose(fp) == EOF)
+    rc = -1;
+  if (rc == -1)
+    perror(path);
+
+  return rc;
+}
+
+/* -q START:END, either end optional; END is exclusive. */
+static int
+parse_range(char const *spec, uint64_t *start, uint64_t *end)
+{
+  char *p;
+
+  *start = 0;
+  *end = UINT64_MAX;
+  if (*spec != ':')
+    *start = strtoull(spec, &p, 0);
+  else
+    p = (char *)spec;
+  if (*p++ != ':')
+    return -1;
+  if (*p)
+    *end = strtoull(p, &p, 0);
+
+  return *p || *start > *end ? -1 : 0;
+}
+
+static int
+run_index(char const *index_path, int n_paths, char *paths[], size_t block_size,
+          int n_queries, char *queries[], unsigned n_threads)
+{
+  HsIndex ix;
+  int rc = 0;
+
+  if (n_paths != 1) {
+    fprintf(stderr, "-i takes exactly one image\n");
+    return -1;
+  }
+
+  if (n_queries == 0) {
+    if (index_build(index_path, paths[0], block_size, n_threads) == -1)
+      return -1;
+    print_stats(stdout, &byte_hist);
+    return 0;
+  }
+
+  if (index_open(&ix, index_path, paths[0]) == -1)
+    return -1;
+
+  for (int i = 0; i < n_queries; i++)
+  {
+    uint64_t start, end;
+    HsHist h;
+
+    if (parse_range(queries[i], &start, &end) == -1) {
+      fprintf(stderr, "bad range '%s'\n", queries[i]);
+      rc = -1;
+      continue;
+    }
+    if (end > ix.hdr->file_size)
+      end = ix.hdr->file_size;
+
+    hs_init(&h);
+    if (index_query(&ix, start, end, &h) == -1) {
+      rc = -1;
+      continue;
+    }
+    printf("Range [%"PRIu64", %"PRIu64"):\n", start, end);
+    print_stats(stdout, &h);
+  }
+
+  index_close(&ix);
+  return rc;
+}
+
+static void
+usage(char const *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-j threads] [-k kernel] [-r] [-p] [-2 matrix [-s stride]]\n"
+          "       [-c columns -l record] [-e profile [-w window[:step]]] [path...]\n"
+          "       %s -i index [-B block] [-q start:end ...] image\n"
+          "       %s -A width [-C confidence] [-B block] file\n"
+          "       %s -x dump [path...]\n", argv0, argv0, argv0, argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
-  process(stdin);
-  print_stats();
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char const *kernel = NULL;
+  bool recurse = false;
+  bool per_file = false;
+  char const *pair_path = NULL;
+  long stride = 1;
+  char const *column_path = NULL;
+  long record_len = 0;
+  char const *entropy_path = NULL;
+  char *window_arg = NULL;
+  char const *index_path = NULL;
+  char const *dump_path = NULL;
+  long block_size = 65536;
+  double approx_width = 0.0;
+  double confidence = 0.95;
+  char **queries = calloc((size_t)argc, sizeof(*queries));
+  int n_queries = 0;
+  int opt;
+  int rc = 0;
 
-  return 0;
+  while ((opt = getopt(argc, argv, "j:k:rp2:s:c:l:e:w:i:B:q:A:C:x:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'j':
+        n_threads = strtol(optarg, NULL, 10);
+        break;
+
+      case 'k':
+        kernel = optarg;
+        break;
+
+      case 'r':
+        recurse = true;
+        break;
+
+      case 'p':
+        per_file = true;
+        break;
+
+      case '2':
+        pair_path = optarg;
+        break;
+
+      case 's':
+        stride = strtol(optarg, NULL, 10);
+        break;
+
+      case 'c':
+        column_path = optarg;
+        break;
+
+      case 'l':
+        record_len = strtol(optarg, NULL, 0);
+        break;
+
+      case 'e':
+        entropy_path = optarg;
+        break;
+
+      case 'w':
+        window_arg = optarg;
+        break;
+
+      case 'i':
+        index_path = optarg;
+        break;
+
+      case 'B':
+        block_size = strtol(optarg, NULL, 0);
+        break;
+
+      case 'q':
+        queries[n_queries++] = optarg;
+        break;
+
+      case 'A':
+        approx_width = strtod(optarg, NULL);
+        break;
+
+      case 'C':
+        confidence = strtod(optarg, NULL);
+        break;
+
+      case 'x':
+        dump_path = optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (hs_select_kernel(kernel) == -1) {
+    fprintf(stderr, "kernel '%s' not available; choose from:", kernel);
+    for (size_t i = 0; i < hs_kernel_count(); i++)
+    {
+      bool ok;
+      char const *name = hs_kernel_info(i, &ok);
+      if (ok)
+        fprintf(stderr, " %s", name);
+    }
+    fprintf(stderr, "\n");
+    return 1;
+  }
+
+  if (n_threads < 1)
+    n_threads = 1;
+  if (n_threads > MAX_THREADS)
+    n_threads = MAX_THREADS;
+
+  /* Blocks are counted in one kernel call into uint32_t counters. */
+  if (block_size < 1 || (size_t)block_size > HS_KERNEL_MAX_BYTES) {
+    fprintf(stderr, "bad block size %ld\n", block_size);
+    return 1;
+  }
+
+  if (approx_width > 0.0) {
+    free(queries);
+    if (optind != argc - 1 || !(confidence > 0.0 && confidence < 1.0)) {
+      usage(argv[0]);
+      return 1;
+    }
+    /* Reads are mostly waiting on the device; go deeper than the cores. */
+    unsigned depth = 4 * (unsigned)n_threads;
+    if (depth < 16)
+      depth = 16;
+    if (depth > MAX_THREADS)
+      depth = MAX_THREADS;
+    return process_approx(argv[optind], (size_t)block_size, approx_width,
+                          confidence, depth) == -1;
+  }
+
+  /* The dump owns stdout when it goes there; the statistics move aside. */
+  if (dump_path) {
+    free(queries);
+    rc = run_dump(dump_path, argc - optind, &argv[optind]) == -1;
+
+    HsSummary summary;
+    if (rc == 0 && hs_finalize(&byte_hist, &summary) == 0)
+      print_stats(strcmp(dump_path, "-") ? stdout : stderr, &byte_hist);
+    return rc;
+  }
+
+  if (index_path) {
+    rc = run_index(index_path, argc - optind, &argv[optind], (size_t)block_size,
+                   n_queries, queries, (unsigned)n_threads) == -1;
+    free(queries);
+    return rc;
+  }
+  free(queries);
+
+  if (pair_path) {
+    if (stride < 1 || (size_t)stride > PAIR_MAX_STRIDE) {
+      fprintf(stderr, "stride must be between 1 and %zu\n", PAIR_MAX_STRIDE);
+      return 1;
+    }
+    pair_stride = (size_t)stride;
+    if (!(pair_counts = calloc(65536, sizeof(*pair_counts)))) {
+      perror("calloc");
+      return 1;
+    }
+  }
+
+  if (column_path) {
+    if (record_len < 1 || (size_t)record_len > COLUMN_MAX_LEN) {
+      fprintf(stderr, "record length must be between 1 and %zu\n", COLUMN_MAX_LEN);
+      return 1;
+    }
+    column_len = (size_t)record_len;
+    if (!(column_counts = calloc(column_len * 256, sizeof(*column_counts)))) {
+      perror("calloc");
+      return 1;
+    }
+  }
+
+  static HsEntropy entropy;
+  FILE *entropy_out = NULL;
+  if (entropy_path) {
+    char const *spec = window_arg ? window_arg : "65536";
+    char *end;
+    size_t window = strtoull(spec, &end, 0);
+    size_t step = *end == ':' ? strtoull(end + 1, &end, 0) : window;
+
+    if (window < 1 || window > ENTROPY_MAX_WINDOW || step < 1 || *end) {
+      fprintf(stderr, "bad entropy window '%s'\n", spec);
+      return 1;
+    }
+    if (recurse) {
+      fprintf(stderr, "-e takes files, not directories\n");
+      return 1;
+    }
+    if (!(entropy_out = fopen(entropy_path, "w"))) {
+      perror(entropy_path);
+      return 1;
+    }
+    if (entropy_init(&entropy, entropy_out, window, step) == -1)
+      return 1;
+    entropy_state = &entropy;
+    n_threads = 1;
+  }
+
+  if (optind == argc && process_fd(STDIN_FILENO, "stdin", (unsigned)n_threads) == -1)
+    rc = 1;
+
+  if (optind < argc && entropy_state) {
+    if (process_sequential(argc - optind, &argv[optind]) == -1)
+      rc = 1;
+  } else if (optind < argc) {
+    if (process_paths(argc - optind, &argv[optind], (unsigned)n_threads,
+                      recurse, per_file) == -1)
+      rc = 1;
+  }
+
+  if (entropy_state) {
+    entropy_free(entropy_state);
+    if (fclose(entropy_out) == EOF) {
+      perror(entropy_path);
+      rc = 1;
+    }
+  }
+
+  HsSummary summary;
+  if (hs_finalize(&byte_hist, &summary) == -1) {
+    fprintf(stderr, "histogram inconsistent: bins don't sum to %"PRIu64" bytes\n",
+            byte_hist.total);
+    return 1;
+  }
+
+  print_stats(stdout, &byte_hist);
+
+  if (pair_path && write_counts(pair_path, pair_counts, 65536) == -1)
+    rc = 1;
+  if (column_path && write_counts(column_path, column_counts, column_len * 256) == -1)
+    rc = 1;
+
+  return rc;
 }
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "bench.h"
+#include "corpus.h"
+#include "hstat.h"
+
+#define MAX_REPS 1000
+#define BENCH_SEED 0x68657873746174
+
+extern char **environ;
+
+typedef struct BenchRun_s {
+  double ns;
+  double cycles;
+} BenchRun;
+
+typedef struct PipeFeed_s {
+  int fd;
+  uint8_t const *p;
+  size_t n;
+} PipeFeed;
+
+/* An I/O mode is a hex_stats command line and where its input comes
+ * from: "-" in argv is replaced by the input path; otherwise stdin is
+ * the file itself, which hex_stats maps, or a pipe fed from memory. */
+typedef struct IoMode_s {
+  char const *name;
+  char const *argv[4];
+  bool stdin_file;
+} IoMode;
+
+static IoMode const io_modes[] = {
+  { "mmap", { NULL }, true },
+  { "mmap-1t", { "-j", "1", NULL }, true },
+  { "pool", { "-", NULL }, false },
+  { "pipe", { NULL }, false },
+};
+
+static double tsc_ghz = 0.0;
+static bool first_result = true;
+
+static double
+cycles(void)
+{
+#ifdef HAVE_TSC
+  return (double)__rdtsc();
+#else
+  return 0.0;
+#endif
+}
+
+/* The TSC ticks at a fixed reference rate, so cycles per byte here are
+ * reference cycles; calibrate once against the monotonic clock. */
+static void
+calibrate_tsc(void)
+{
+#ifdef HAVE_TSC
+  double t0 = bench_now_ns(), c0 = cycles(), t1;
+
+  do
+    t1 = bench_now_ns();
+  while (t1 - t0 < 50e6);
+  tsc_ghz = (cycles() - c0) / (t1 - t0);
+#endif
+}
+
+/* One JSON object per measurement. Throughput is per repetition; the
+ * spread is (max - min) / median of those. */
+static void
+report(char const *bench, char const *name, char const *corpus, size_t size,
+       BenchRun const *runs, int reps, uint64_t iters, char const *error)
+{
+  double gbps[MAX_REPS], cpb[MAX_REPS];
+
+  printf("%s\n    {\"bench\": \"%s\", \"name\": \"%s\", \"corpus\": \"%s\", "
+         "\"size\": %zu, ", first_result ? "" : ",", bench, name, corpus, size);
+  first_result = false;
+  if (error) {
+    printf("\"error\": \"%s\"}", error);
+    return;
+  }
+
+  for (int r = 0; r < reps; r++)
+  {
+    double bytes = (double)size * (double)iters;
+    gbps[r] = bytes / runs[r].ns;
+    cpb[r] = runs[r].cycles / bytes;
+  }
+
+  BenchStats g = bench_stats(gbps, reps);
+  printf("\"reps\": %d, \"iters\": %" PRIu64 ", ", reps, iters);
+  bench_print_stats("gbps", &g, 4);
+  printf(", \"spread\": %.4f, ", g.median > 0 ? (g.max - g.min) / g.median : 0.0);
+  if (tsc_ghz > 0) {
+    BenchStats c = bench_stats(cpb, reps);
+    bench_print_stats("cycles_per_byte", &c, 4);
+  } else {
+    printf("\"cycles_per_byte\": null");
+  }
+  printf("}");
+  fflush(stdout);
+}
+
+/* In-process kernel timing. Small inputs are repeated so that each
+ * repetition lasts at least min_ns; the iteration count is fixed from
+ * a warm-up run so every repetition does the same work. */
+static void
+bench_kernel(char const *kernel, char const *corpus, uint8_t const *buf,
+             size_t size, int reps, double min_ns)
+{
+  BenchRun runs[MAX_REPS];
+  uint64_t iters = 1;
+  HsHist h;
+  double t;
+
+  hs_init(&h);
+  t = bench_now_ns();
+  hs_update(&h, buf, size);
+  t = bench_now_ns() - t;
+  if (t < min_ns)
+    iters = (uint64_t)(min_ns / (t > 1.0 ? t : 1.0)) + 1;
+
+  for (int r = 0; r < reps; r++)
+  {
+    double t0, c0;
+
+    hs_init(&h);
+    t0 = bench_now_ns();
+    c0 = cycles();
+    for (uint64_t i = 0; i < iters; i++)
+      hs_update(&h, buf, size);
+    runs[r].cycles = cycles() - c0;
+    runs[r].ns = bench_now_ns() - t0;
+
+    if (h.total != size * iters) {
+      report("kernel", kernel, corpus, size, runs, 0, 0, "byte count mismatch");
+      return;
+    }
+  }
+
+  report("kernel", kernel, corpus, size, runs, reps, iters, NULL);
+}
+
+static void
+pipe_feed(PipeFeed *f)
+{
+
+  while (f->n > 0)
+  {
+    ssize_t w = write(f->fd, f->p, f->n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    f->p += w;
+    f->n -= (size_t)w;
+  }
+  close(f->fd);
+}
+
+/* Runs hex_stats once over path (or over buf through a pipe) with its
+ * output discarded. Returns the exit status, or -1. */
+static int
+run_io(char const *exe, IoMode const *mode, char const *path,
+       uint8_t const *buf, size_t size, BenchRun *run)
+{
+  char const *argv[8] = { exe };
+  posix_spawn_file_actions_t fa;
+  int pipefd[2] = { -1, -1 };
+  PipeFeed feed;
+  pid_t pid;
+  int status, argc = 1;
+  bool has_path = false;
+  double t0, c0;
+
+  for (int i = 0; mode->argv[i]; i++) {
+    bool is_path = !strcmp(mode->argv[i], "-");
+    argv[argc++] = is_path ? path : mode->argv[i];
+    has_path |= is_path;
+  }
+  argv[argc] = NULL;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  if (mode->stdin_file) {
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, path, O_RDONLY, 0);
+  } else if (!has_path) {
+    if (pipe(pipefd) == -1) {
+      posix_spawn_file_actions_destroy(&fa);
+      return -1;
+    }
+    posix_spawn_file_actions_adddup2(&fa, pipefd[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&fa, pipefd[1]);
+  }
+
+  t0 = bench_now_ns();
+  c0 = cycles();
+  errno = posix_spawn(&pid, exe, &fa, NULL, (char **)argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (pipefd[0] != -1)
+    close(pipefd[0]);
+  if (errno != 0) {
+    if (pipefd[1] != -1)
+      close(pipefd[1]);
+    return -1;
+  }
+
+  if (pipefd[1] != -1) {
+    feed = (PipeFeed){ .fd = pipefd[1], .p = buf, .n = size };
+    pipe_feed(&feed);
+  }
+
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR)
+      return -1;
+  run->cycles = cycles() - c0;
+  run->ns = bench_now_ns() - t0;
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int
+write_file(char const *path, uint8_t const *p, size_t n)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd == -1)
+    return -1;
+  while (n > 0)
+  {
+    ssize_t w = write(fd, p, n);
+    if (w <= 0) {
+      close(fd);
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return close(fd);
+}
+
+/* End-to-end timing of each engine, including process start-up: the
+ * input file is written first, so it is served from the page cache. */
+static void
+bench_io(char const *exe, char const *dir, char const *corpus,
+         uint8_t const *buf, size_t size, int reps)
+{
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/hs_bench.%ld.%s.%zu", dir, (long)getpid(),
+           corpus, size);
+  if (write_file(path, buf, size) == -1) {
+    perror(path);
+    unlink(path);
+    return;
+  }
+
+  for (size_t m = 0; m < sizeof(io_modes) / sizeof(io_modes[0]); m++)
+  {
+    BenchRun runs[MAX_REPS];
+    char const *error = NULL;
+
+    for (int r = 0; r < reps && !error; r++)
+      if (run_io(exe, &io_modes[m], path, buf, size, &runs[r]) != 0)
+        error = "hex_stats failed";
+    report("io", io_modes[m].name, corpus, size, runs, reps, 1, error);
+  }
+
+  unlink(path);
+}
+
+static void
+usage(char const *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-n min-size] [-m max-size] [-f factor] [-r reps]\n"
+          "       [-t min-ms] [-c corpus,...] [-k kernel,...] [-x hex_stats | -X]\n"
+          "       [-d tmpdir]\n", argv0);
+  fprintf(stderr, "corpora:");
+  for (size_t i = 0; i < corpus_count(); i++)
+    fprintf(stderr, " %s", corpus_name(i));
+  fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t min_size = (size_t)4 << 10;
+  size_t max_size = (size_t)1 << 30;
+  size_t factor = 16;
+  int reps = 7;
+  double min_ms = 20.0;
+  char const *corpora = NULL;
+  char const *kernels = NULL;
+  char const *exe = "./hex_stats";
+  char const *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  uint8_t *buf;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:f:r:t:c:k:x:Xd:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        if (bench_parse_size(optarg, &min_size) == -1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'm':
+        if (bench_parse_size(optarg, &max_size) == -1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'f':
+        factor = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 't':
+        min_ms = atof(optarg);
+        break;
+      case 'c':
+        corpora = optarg;
+        break;
+      case 'k':
+        kernels = optarg;
+        break;
+      case 'x':
+        exe = optarg;
+        break;
+      case 'X':
+        exe = NULL;
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (reps < 1 || reps > MAX_REPS || factor < 2 || min_size > max_size) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (exe && access(exe, X_OK) == -1) {
+    fprintf(stderr, "%s: not executable, skipping I/O modes\n", exe);
+    exe = NULL;
+  }
+
+  buf = mmap(NULL, max_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  madvise(buf, max_size, MADV_HUGEPAGE);
+  signal(SIGPIPE, SIG_IGN);
+  calibrate_tsc();
+
+  printf("{\n  \"host\": {\"cpus\": %ld, \"default_kernel\": \"%s\", "
+         "\"tsc_ghz\": %.4f},\n", sysconf(_SC_NPROCESSORS_ONLN),
+         hs_kernel_name(), tsc_ghz);
+  printf("  \"config\": {\"min_size\": %zu, \"max_size\": %zu, \"factor\": %zu, "
+         "\"reps\": %d, \"min_ms\": %.1f},\n", min_size, max_size, factor, reps,
+         min_ms);
+  printf("  \"results\": [");
+
+  for (size_t c = 0; c < corpus_count(); c++)
+  {
+    char const *corpus = corpus_name(c);
+
+    if (!bench_listed(corpora, corpus))
+      continue;
+    if (corpus_fill(c, buf, max_size, BENCH_SEED) == -1) {
+      fprintf(stderr, "%s: cannot generate corpus\n", corpus);
+      return 1;
+    }
+
+    for (size_t size = min_size; size <= max_size; )
+    {
+      for (size_t k = 0; k < hs_kernel_count(); k++)
+      {
+        bool supported;
+        char const *name = hs_kernel_info(k, &supported);
+
+        if (!supported || !bench_listed(kernels, name))
+          continue;
+        hs_select_kernel(name);
+        bench_kernel(name, corpus, buf, size, reps, min_ms * 1e6);
+      }
+
+      if (exe)
+        bench_io(exe, dir, corpus, buf, size, reps);
+
+      if (size == max_size)
+        break;
+      size = size > max_size / factor ? max_size : size * factor;
+    }
+  }
+
+  printf("\n  ]\n}\n");
+  munmap(buf, max_size);
+  return 0;
+}
@@ -0,0 +1,378 @@
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+#include "hstat.h"
+
+/* A vector whose bytes are mostly one value is counted with a popcount and
+ * only the stragglers go through the tables. Past this many stragglers
+ * the unrolled path is cheaper. */
+#define KERNEL_SPARSE_MAX 16
+
+typedef void (*HsKernelFn)(uint32_t counts[256], uint8_t const *p, size_t n);
+
+typedef struct HsKernel_s {
+  char const *name;
+  HsKernelFn fn;
+  bool (*supported)(void);
+} HsKernel;
+
+
+/* Spread the eight bytes of a word over eight tables so that repeated
+ * bytes don't serialize on store-to-load forwarding of a single counter. */
+#define COUNT_WORD_8WAY(t, w) \
+  do { \
+    (t)[0][(w)         & 0xff]++; \
+    (t)[1][((w) >>  8) & 0xff]++; \
+    (t)[2][((w) >> 16) & 0xff]++; \
+    (t)[3][((w) >> 24) & 0xff]++; \
+    (t)[4][((w) >> 32) & 0xff]++; \
+    (t)[5][((w) >> 40) & 0xff]++; \
+    (t)[6][((w) >> 48) & 0xff]++; \
+    (t)[7][((w) >> 56)       ]++; \
+  } while (0)
+
+static void
+merge_subtables(uint32_t counts[256], int n_tables, uint32_t t[][256])
+{
+  for (int b = 0; b < 256; b++)
+    for (int k = 0; k < n_tables; k++)
+      counts[b] += t[k][b];
+}
+
+static void
+count_ref(uint32_t counts[256], uint8_t const *p, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    counts[p[i]]++;
+}
+
+static void
+count_scalar4(uint32_t counts[256], uint8_t const *p, size_t n)
+{
+  uint32_t t[4][256] = { 0 };
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, &p[i], sizeof(w));
+    t[0][w         & 0xff]++;
+    t[1][(w >>  8) & 0xff]++;
+    t[2][(w >> 16) & 0xff]++;
+    t[3][(w >> 24) & 0xff]++;
+    t[0][(w >> 32) & 0xff]++;
+    t[1][(w >> 40) & 0xff]++;
+    t[2][(w >> 48) & 0xff]++;
+    t[3][(w >> 56)       ]++;
+  }
+  for (; i < n; i++)
+    t[0][p[i]]++;
+
+  merge_subtables(counts, 4, t);
+}
+
+static void
+count_scalar8(uint32_t counts[256], uint8_t const *p, size_t n)
+{
+  uint32_t t[8][256] = { 0 };
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, &p[i], sizeof(w));
+    COUNT_WORD_8WAY(t, w);
+  }
+  for (; i < n; i++)
+    t[0][p[i]]++;
+
+  merge_subtables(counts, 8, t);
+}
+
+static bool
+cpu_any(void)
+{
+  return true;
+}
+
+#if defined(__x86_64__)
+/*
+ * The vector kernels compare each vector against a "hot" byte, the value
+ * that dominated the previous vector. Runs and sparse dumps then cost one
+ * compare and a popcount per vector, plus one table update per straggler.
+ * Dense random data falls back to the 8-way tables.
+ */
+__attribute__((target("avx2,bmi,popcnt")))
+static void
+count_avx2(uint32_t counts[256], uint8_t const *p, size_t n)
+{
+  uint32_t t[8][256] = { 0 };
+  uint8_t hot = n ? p[0] : 0;
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)&p[i]);
+    __m256i eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)hot));
+    uint32_t cold = ~(uint32_t)_mm256_movemask_epi8(eq);
+    int n_cold = __builtin_popcount(cold);
+
+    if (n_cold <= KERNEL_SPARSE_MAX) {
+      t[0][hot] += 32 - n_cold;
+      for (unsigned k = 1; cold; cold &= cold - 1, k++)
+        t[k & 7][p[i + __builtin_ctz(cold)]]++;
+      continue;
+    }
+
+    for (int k = 0; k < 32; k += 8)
+    {
+      uint64_t w;
+      memcpy(&w, &p[i + k], sizeof(w));
+      COUNT_WORD_8WAY(t, w);
+    }
+    hot = p[i + 31];
+  }
+  for (; i < n; i++)
+    t[0][p[i]]++;
+
+  merge_subtables(counts, 8, t);
+}
+
+__attribute__((target("avx512f,avx512bw,bmi,popcnt")))
+static void
+count_avx512(uint32_t counts[256], uint8_t const *p, size_t n)
+{
+  uint32_t t[8][256] = { 0 };
+  uint8_t hot = n ? p[0] : 0;
+  size_t i = 0;
+
+  for (; i + 64 <= n; i += 64)
+  {
+    __m512i v = _mm512_loadu_si512((void const *)&p[i]);
+    uint64_t cold = ~_mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)hot));
+    int n_cold = __builtin_popcountll(cold);
+
+    if (n_cold <= KERNEL_SPARSE_MAX) {
+      t[0][hot] += 64 - n_cold;
+      for (unsigned k = 1; cold; cold &= cold - 1, k++)
+        t[k & 7][p[i + __builtin_ctzll(cold)]]++;
+      continue;
+    }
+
+    for (int k = 0; k < 64; k += 8)
+    {
+      uint64_t w;
+      memcpy(&w, &p[i + k], sizeof(w));
+      COUNT_WORD_8WAY(t, w);
+    }
+    hot = p[i + 63];
+  }
+  for (; i < n; i++)
+    t[0][p[i]]++;
+
+  merge_subtables(counts, 8, t);
+}
+
+static bool
+cpu_avx2(void)
+{
+  return __builtin_cpu_supports("avx2")
+      && __builtin_cpu_supports("bmi")
+      && __builtin_cpu_supports("popcnt");
+}
+
+static bool
+cpu_avx512(void)
+{
+  return __builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512bw")
+      && __builtin_cpu_supports("bmi")
+      && __builtin_cpu_supports("popcnt");
+}
+#endif /* defined(__x86_64__) */
+
+/* Fastest first; the default is the first one the CPU supports. */
+static HsKernel const k_kernels[] = {
+#if defined(__x86_64__)
+  { "avx512",  count_avx512,  cpu_avx512 },
+  { "avx2",    count_avx2,    cpu_avx2 },
+#endif
+  { "scalar8", count_scalar8, cpu_any },
+  { "scalar4", count_scalar4, cpu_any },
+  { "ref",     count_ref,     cpu_any },
+};
+
+#define N_KERNELS (sizeof(k_kernels) / sizeof(k_kernels[0]))
+
+static _Atomic(HsKernel const *) kernel = NULL;
+static once_flag kernel_once = ONCE_FLAG_INIT;
+
+static void
+kernel_default(void)
+{
+  __builtin_cpu_init();
+
+  /* The last entry runs anywhere, so this always finds one. */
+  for (size_t i = 0; i < N_KERNELS; i++)
+    if (k_kernels[i].supported()) {
+      HsKernel const *expected = NULL;
+      atomic_compare_exchange_strong(&kernel, &expected, &k_kernels[i]);
+      return;
+    }
+}
+
+static HsKernel const *
+kernel_get(void)
+{
+  HsKernel const *k = atomic_load_explicit(&kernel, memory_order_acquire);
+
+  if (!k) {
+    call_once(&kernel_once, kernel_default);
+    k = atomic_load_explicit(&kernel, memory_order_acquire);
+  }
+  return k;
+}
+
+int
+hs_select_kernel(char const *name)
+{
+  if (!name) {
+    kernel_get();
+    return 0;
+  }
+
+  __builtin_cpu_init();
+  for (size_t i = 0; i < N_KERNELS; i++)
+    if (!strcmp(name, k_kernels[i].name) && k_kernels[i].supported()) {
+      atomic_store_explicit(&kernel, &k_kernels[i], memory_order_release);
+      return 0;
+    }
+
+  return -1;
+}
+
+char const *
+hs_kernel_name(void)
+{
+  return kernel_get()->name;
+}
+
+size_t
+hs_kernel_count(void)
+{
+  return N_KERNELS;
+}
+
+char const *
+hs_kernel_info(size_t i, bool *supported)
+{
+  if (i >= N_KERNELS)
+    return NULL;
+
+  __builtin_cpu_init();
+  if (supported)
+    *supported = k_kernels[i].supported();
+  return k_kernels[i].name;
+}
+
+void
+hs_count_u32(uint32_t counts[256], void const *p, size_t n)
+{
+  kernel_get()->fn(counts, p, n);
+}
+
+void
+hs_init(HsHist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+static int
+hist_add(HsHist *h, uint32_t const partial[256], uint64_t n)
+{
+  bool overflow = __builtin_add_overflow(h->total, n, &h->total);
+
+  for (int b = 0; b < 256; b++)
+    overflow |= __builtin_add_overflow(h->counts[b], partial[b], &h->counts[b]);
+
+  if (overflow)
+    errno = EOVERFLOW;
+  return overflow ? -1 : 0;
+}
+
+/* Kernels only ever see bounded slices and report into narrow partial
+ * tables, which are widened here. */
+int
+hs_update(HsHist *h, void const *buf, size_t n)
+{
+  HsKernelFn fn = kernel_get()->fn;
+  uint8_t const *p = buf;
+
+  while (n > 0)
+  {
+    uint32_t partial[256] = { 0 };
+    size_t len = n < HS_KERNEL_MAX_BYTES ? n : HS_KERNEL_MAX_BYTES;
+
+    fn(partial, p, len);
+    if (hist_add(h, partial, len) == -1)
+      return -1;
+    p += len;
+    n -= len;
+  }
+
+  return 0;
+}
+
+int
+hs_merge(HsHist *dst, HsHist const *src)
+{
+  bool overflow = __builtin_add_overflow(dst->total, src->total, &dst->total);
+
+  for (int b = 0; b < 256; b++)
+    overflow |= __builtin_add_overflow(dst->counts[b], src->counts[b], &dst->counts[b]);
+
+  if (overflow)
+    errno = EOVERFLOW;
+  return overflow ? -1 : 0;
+}
+
+/* Also checks the bins account for every byte counted; anything else
+ * means a kernel dropped or double-counted input. */
+int
+hs_finalize(HsHist const *h, HsSummary *out)
+{
+  uint64_t sum = 0;
+  double bits = 0.0;
+
+  memset(out, 0, sizeof(*out));
+  out->total = h->total;
+
+  for (int b = 0; b < 256; b++)
+  {
+    if (__builtin_add_overflow(sum, h->counts[b], &sum)) {
+      errno = EOVERFLOW;
+      return -1;
+    }
+    if (h->counts[b] == 0)
+      continue;
+
+    double p = (double)h->counts[b] / (double)h->total;
+    bits -= p * log2(p);
+    out->distinct++;
+    if (h->counts[b] > h->counts[out->most_common])
+      out->most_common = (uint8_t)b;
+  }
+
+  if (sum != h->total) {
+    errno = EINVAL;
+    return -1;
+  }
+  out->entropy = bits;
+
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef __hstat_h__
+#define __hstat_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental byte histograms.
+ *
+ *   HsHist h;
+ *   hs_init(&h);
+ *   while (...)
+ *     hs_update(&h, buf, len);
+ *   hs_finalize(&h, &summary);
+ *
+ * An HsHist is plain per-instance state: any number of them may be
+ * updated concurrently from different threads, one thread per instance,
+ * and partial results (per chunk, thread or file) combine with
+ * hs_merge(). There are no global tables; the only shared state is the
+ * choice of counting kernel, made once and read-only afterwards.
+ *
+ * Counters are 64 bits wide and every addition is checked: functions
+ * returning int give 0, or -1 with errno set to EOVERFLOW rather than
+ * a wrapped count.
+ */
+
+/* hs_count_u32() takes at most this many bytes per call. */
+#define HS_KERNEL_MAX_BYTES ((size_t)1 << 30)
+
+typedef struct HsHist_s {
+  uint64_t counts[256];
+  uint64_t total;
+} HsHist;
+
+typedef struct HsSummary_s {
+  uint64_t total;
+  unsigned distinct;
+  uint8_t most_common;
+  double entropy;
+} HsSummary;
+
+void hs_init(HsHist *h);
+int hs_update(HsHist *h, void const *p, size_t n);
+int hs_merge(HsHist *dst, HsHist const *src);
+int hs_finalize(HsHist const *h, HsSummary *out);
+
+/* The raw kernel: adds the bytes of p[0..n) into narrow counters. The
+ * caller keeps n <= HS_KERNEL_MAX_BYTES and widens before they wrap. */
+void hs_count_u32(uint32_t counts[256], void const *p, size_t n);
+
+/* Kernel selection. The fastest kernel the CPU supports is used unless
+ * hs_select_kernel() names another; call it before counting starts.
+ * Returns -1 if the name is unknown or the CPU lacks the instructions. */
+int hs_select_kernel(char const *name);
+char const *hs_kernel_name(void);
+size_t hs_kernel_count(void);
+char const *hs_kernel_info(size_t i, bool *supported);
+
+#endif /* !defined(__hstat_h__) */
@@ -0,0 +1,591 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "huff.h"
+
+/* Stable bottom-up merge sort of the used symbols by count, so ties stay
+ * in symbol order and the result is deterministic. */
+static void
+sort_symbols(uint64_t const counts[256], uint8_t *syms, unsigned n)
+{
+  uint8_t tmp[256];
+  uint8_t *src = syms, *dst = tmp;
+
+  for (unsigned width = 1; width < n; width *= 2)
+  {
+    for (unsigned lo = 0; lo < n; lo += 2 * width)
+    {
+      unsigned mid = lo + width < n ? lo + width : n;
+      unsigned hi = lo + 2 * width < n ? lo + 2 * width : n;
+      unsigned i = lo, j = mid, k = lo;
+
+      while (i < mid && j < hi)
+        dst[k++] = counts[src[j]] < counts[src[i]] ? src[j++] : src[i++];
+      while (i < mid)
+        dst[k++] = src[i++];
+      while (j < hi)
+        dst[k++] = src[j++];
+    }
+    uint8_t *t = src;
+    src = dst;
+    dst = t;
+  }
+
+  if (src != syms)
+    memcpy(syms, src, n);
+}
+
+/*
+ * Unlimited Huffman code lengths in place, Moffat and Katajainen's
+ * three-pass method over weights in ascending order: w[i] becomes the
+ * depth of leaf i. Usually the result already fits the limit and the
+ * package-merge below can be skipped.
+ */
+static void
+huffman_in_place(uint64_t *w, unsigned n)
+{
+  unsigned root = 0, leaf = 2, next;
+
+  /* Left to right: combine, leaving parent indices behind. */
+  w[0] += w[1];
+  for (next = 1; next < n - 1; next++)
+  {
+    if (leaf >= n || w[root] < w[leaf]) {
+      w[next] = w[root];
+      w[root++] = next;
+    } else {
+      w[next] = w[leaf++];
+    }
+    if (leaf >= n || (root < next && w[root] < w[leaf])) {
+      w[next] += w[root];
+      w[root++] = next;
+    } else {
+      w[next] += w[leaf++];
+    }
+  }
+
+  /* Right to left: parent indices to internal node depths. */
+  w[n - 2] = 0;
+  for (unsigned i = n - 2; i-- > 0; )
+    w[i] = w[w[i]] + 1;
+
+  /* Right to left: internal depths to leaf depths. */
+  unsigned avail = 1, used = 0, depth = 0;
+  unsigned r = n - 1;
+  next = n;
+  while (avail > 0)
+  {
+    while (r-- > 0 && w[r] == depth)
+      used++;
+    r++;
+    while (avail > used)
+    {
+      w[--next] = depth;
+      avail--;
+    }
+    avail = 2 * used;
+    depth++;
+    used = 0;
+  }
+}
+
+/*
+ * Package-merge. List 0 is the leaves in weight order; list l merges the
+ * leaves with the pairwise packages of list l - 1. The cheapest 2n - 2
+ * items of the last list are the optimal code. Unwinding it only needs
+ * to know which items were packages: of the first m items of a list, the
+ * leaves are always the lightest m - p symbols (one more bit each), and
+ * the p packages are the first 2p items of the list below.
+ */
+int
+huff_lengths(uint64_t const counts[256], unsigned max_bits, uint8_t lengths[256])
+{
+  uint8_t syms[256];
+  uint64_t leaf[257];
+  uint64_t pkg[257];
+  uint64_t weight[2][512];
+  uint8_t is_pkg[HUFF_MAX_BITS][512];
+  uint64_t total = 0;
+  unsigned n = 0;
+
+  memset(lengths, 0, 256);
+  if (max_bits == 0 || max_bits > HUFF_MAX_BITS)
+    return -1;
+
+  for (unsigned s = 0; s < 256; s++)
+    if (counts[s]) {
+      syms[n++] = (uint8_t)s;
+      /* A package can hold a leaf once per level; keep the sums exact. */
+      if (__builtin_add_overflow(total, counts[s], &total) || total > UINT64_MAX >> 4)
+        return -1;
+    }
+
+  if (n == 0)
+    return 0;
+  if (n == 1) {
+    lengths[syms[0]] = 1;
+    return 0;
+  }
+  if (n > 1u << max_bits)
+    return -1;
+
+  sort_symbols(counts, syms, n);
+  for (unsigned i = 0; i < n; i++)
+    leaf[i] = counts[syms[i]];
+
+  memcpy(weight[0], leaf, n * sizeof(*leaf));
+  huffman_in_place(weight[0], n);
+  if (weight[0][0] <= max_bits) {
+    for (unsigned i = 0; i < n; i++)
+      lengths[syms[i]] = (uint8_t)weight[0][i];
+    return 0;
+  }
+
+  unsigned len = n;
+  memcpy(weight[0], leaf, n * sizeof(*leaf));
+  memset(is_pkg[0], 0, n);
+  leaf[n] = UINT64_MAX;
+
+  for (unsigned l = 1; l < max_bits; l++)
+  {
+    uint64_t const *below = weight[(l - 1) & 1];
+    uint64_t *out = weight[l & 1];
+    uint8_t *flag = is_pkg[l];
+    unsigned n_pkg = len / 2, total = n + n_pkg;
+    unsigned i = 0, j = 0;
+
+    for (unsigned k = 0; k < n_pkg; k++)
+      pkg[k] = below[2 * k] + below[2 * k + 1];
+    pkg[n_pkg] = UINT64_MAX;
+
+    /* Both lists end in a sentinel, so the merge needs one compare; ties
+     * put the leaf first. */
+    for (unsigned k = 0; k < total; k++)
+    {
+      if (leaf[i] <= pkg[j]) {
+        out[k] = leaf[i++];
+        flag[k] = 0;
+      } else {
+        out[k] = pkg[j++];
+        flag[k] = 1;
+      }
+    }
+    len = total;
+  }
+
+  unsigned m = 2 * n - 2;
+  for (unsigned l = max_bits; l-- > 0; )
+  {
+    unsigned p = 0;
+
+    for (unsigned k = 0; k < m; k++)
+      p += is_pkg[l][k];
+    for (unsigned i = 0; i < m - p; i++)
+      lengths[syms[i]]++;
+    m = 2 * p;
+  }
+
+  return 0;
+}
+
+int
+huff_codes(uint8_t const lengths[256], uint16_t codes[256])
+{
+  unsigned bl_count[HUFF_MAX_BITS + 1] = { 0 };
+  unsigned next[HUFF_MAX_BITS + 1];
+  unsigned code = 0;
+
+  for (unsigned s = 0; s < 256; s++)
+  {
+    if (lengths[s] > HUFF_MAX_BITS)
+      return -1;
+    bl_count[lengths[s]]++;
+  }
+  bl_count[0] = 0;
+
+  for (unsigned bits = 1; bits <= HUFF_MAX_BITS; bits++)
+  {
+    code = (code + bl_count[bits - 1]) << 1;
+    next[bits] = code;
+    if (code + bl_count[bits] > 1u << bits)
+      return -1;
+  }
+
+  for (unsigned s = 0; s < 256; s++)
+    codes[s] = lengths[s] ? (uint16_t)next[lengths[s]]++ : 0;
+
+  return 0;
+}
+
+static unsigned
+reverse_bits(unsigned code, unsigned len)
+{
+  code = (code & 0x5555) << 1 | (code >> 1 & 0x5555);
+  code = (code & 0x3333) << 2 | (code >> 2 & 0x3333);
+  code = (code & 0x0f0f) << 4 | (code >> 4 & 0x0f0f);
+  code = (code & 0x00ff) << 8 | (code >> 8 & 0x00ff);
+  return code >> (16 - len);
+}
+
+void
+huff_enc_table(uint8_t const lengths[256], uint16_t const codes[256], HuffEnc enc[256])
+{
+  for (unsigned s = 0; s < 256; s++)
+  {
+    enc[s].bits = (uint16_t)reverse_bits(codes[s], lengths[s]);
+    enc[s].len = lengths[s];
+  }
+}
+
+/*
+ * Every index whose low len bits are a symbol's reversed code decodes to
+ * it; slots no code reaches (an incomplete code) stay 0, length 0. The
+ * table is grown a bit at a time: doubling a table of 2^b entries keeps
+ * every shorter code's slots, so each symbol is stored once, at its own
+ * length, and the rest is sequential copying.
+ */
+int
+huff_dec_table(uint8_t const lengths[256], uint16_t const codes[256],
+               unsigned table_bits, uint16_t *dec)
+{
+  uint8_t by_len[HUFF_MAX_BITS + 1][256];
+  unsigned n_len[HUFF_MAX_BITS + 1] = { 0 };
+
+  if (table_bits > HUFF_MAX_BITS)
+    return -1;
+  for (unsigned s = 0; s < 256; s++)
+  {
+    if (lengths[s] > table_bits)
+      return -1;
+    by_len[lengths[s]][n_len[lengths[s]]++] = (uint8_t)s;
+  }
+
+  dec[0] = 0;
+  for (unsigned b = 1; b <= table_bits; b++)
+  {
+    size_t half = (size_t)1 << (b - 1);
+
+    memcpy(dec + half, dec, half * sizeof(*dec));
+    for (unsigned i = 0; i < n_len[b]; i++)
+    {
+      unsigned s = by_len[b][i];
+      dec[reverse_bits(codes[s], b)] = (uint16_t)(s | b << 8);
+    }
+  }
+
+  return 0;
+}
+
+void
+huff_pack_lengths(uint8_t const lengths[256], uint8_t out[HUFF_LENGTHS_SIZE])
+{
+  for (unsigned i = 0; i < HUFF_LENGTHS_SIZE; i++)
+    out[i] = (uint8_t)(lengths[2 * i] | lengths[2 * i + 1] << 4);
+}
+
+void
+huff_unpack_lengths(uint8_t const in[HUFF_LENGTHS_SIZE], uint8_t lengths[256])
+{
+  for (unsigned i = 0; i < HUFF_LENGTHS_SIZE; i++)
+  {
+    lengths[2 * i] = in[i] & 0x0f;
+    lengths[2 * i + 1] = in[i] >> 4;
+  }
+}
+
+/* Bitstreams are little-endian 64-bit words at byte granularity. */
+static inline uint64_t
+get64(uint8_t const *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline void
+put64(uint8_t *p, uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+put32(uint8_t *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++, v >>= 8)
+    p[i] = (uint8_t)v;
+}
+
+static inline uint32_t
+get32(uint8_t const *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#define HEADER_SIZE 12
+
+/* Worst case for one stream of m symbols, with room for the 8-byte store
+ * that flushes its last bits. */
+static size_t
+stream_bound(size_t m)
+{
+  return (m * HUFF_CODEC_BITS + 7) / 8 + 16;
+}
+
+size_t
+huff_bound(size_t n)
+{
+  return HEADER_SIZE + 4 * stream_bound(n - 3 * (n / 4));
+}
+
+typedef struct BitWriter_s {
+  uint8_t *p;
+  uint64_t buf;
+  unsigned n;
+} BitWriter;
+
+/* Up to four codes of at most HUFF_CODEC_BITS go in between flushes; the
+ * flush always stores the whole word and advances by the complete bytes,
+ * so there is no branch on how full the buffer is. */
+#define PUT(w, e) \
+  do { \
+    (w).buf |= (uint64_t)(e).bits << (w).n; \
+    (w).n += (e).len; \
+  } while (0)
+
+#define FLUSH(w) \
+  do { \
+    put64((w).p, (w).buf); \
+    (w).p += (w).n >> 3; \
+    (w).buf >>= (w).n & ~7u; \
+    (w).n &= 7; \
+  } while (0)
+
+size_t
+huff_encode(HuffEnc const enc[256], void const *src, size_t n, void *dst)
+{
+  uint8_t const *in = src;
+  uint8_t *out = dst;
+  size_t seg = n / 4, last = n - 3 * seg;
+  size_t slot = stream_bound(last);
+  uint8_t const *s[4];
+  uint8_t *start[4];
+  BitWriter w[4];
+  size_t i = 0;
+
+  for (int k = 0; k < 4; k++)
+  {
+    s[k] = in + k * seg;
+    start[k] = out + HEADER_SIZE + k * slot;
+    w[k] = (BitWriter){ .p = start[k] };
+  }
+
+  /* Fully unrolled, so the writers live in registers rather than w[]. */
+  for (; i + 4 <= seg; i += 4)
+  {
+#pragma GCC unroll 4
+    for (int j = 0; j < 4; j++)
+#pragma GCC unroll 4
+      for (int k = 0; k < 4; k++)
+        PUT(w[k], enc[s[k][i + j]]);
+#pragma GCC unroll 4
+    for (int k = 0; k < 4; k++)
+      FLUSH(w[k]);
+  }
+  for (; i < seg; i++)
+    for (int k = 0; k < 4; k++)
+    {
+      PUT(w[k], enc[s[k][i]]);
+      FLUSH(w[k]);
+    }
+  for (; i < last; i++)
+  {
+    PUT(w[3], enc[s[3][i]]);
+    FLUSH(w[3]);
+  }
+
+  /* Close each stream on a byte boundary, then pack them together. */
+  uint8_t *at = out + HEADER_SIZE;
+  for (int k = 0; k < 4; k++)
+  {
+    put64(w[k].p, w[k].buf);
+    size_t size = (size_t)(w[k].p - start[k]) + (w[k].n + 7) / 8;
+
+    if (k < 3)
+      put32(out + 4 * k, (uint32_t)size);
+    memmove(at, start[k], size);
+    at += size;
+  }
+
+  return (size_t)(at - out);
+}
+
+int
+huff_decoder_init(HuffDecoder *d, uint8_t const lengths[256])
+{
+  uint16_t single[1 << HUFF_CODEC_BITS];
+  uint16_t codes[256];
+  unsigned const mask = (1u << HUFF_CODEC_BITS) - 1;
+
+  if (huff_codes(lengths, codes) == -1
+      || huff_dec_table(lengths, codes, HUFF_CODEC_BITS, single) == -1)
+    return -1;
+
+  /*
+   * Chain single-symbol lookups for as long as whole codes fit in the
+   * table's bits. Slots no code reaches (only in an incomplete code,
+   * hence only in a corrupt stream) still consume bits and emit a
+   * symbol, so decoding always makes progress and the stream length
+   * check catches it.
+   */
+  for (unsigned x = 0; x <= mask; x++)
+  {
+    HuffDecEntry *e = &d->table[x];
+    unsigned used = 0;
+
+    memset(e, 0, sizeof(*e));
+    while (e->count < 4)
+    {
+      uint16_t s = single[(x >> used) & mask];
+      unsigned len = HUFF_DEC_LEN(s);
+
+      if (len == 0 || used + len > HUFF_CODEC_BITS)
+        break;
+      if (e->count == 0)
+        e->first_len = (uint8_t)len;
+      e->sym[e->count++] = HUFF_DEC_SYM(s);
+      used += len;
+    }
+    if (e->count == 0) {
+      e->count = 1;
+      used = HUFF_CODEC_BITS;
+      e->first_len = HUFF_CODEC_BITS;
+    }
+    e->bits = (uint8_t)used;
+  }
+
+  return 0;
+}
+
+typedef struct BitReader_s {
+  uint8_t const *base;
+  size_t size;
+  size_t pos;
+  uint64_t buf;
+  unsigned n;
+} BitReader;
+
+/* Tops the buffer up to 56..63 bits with one unaligned load, without
+ * branching on how many bits were left; needs 8 readable bytes. */
+#define REFILL(r) \
+  do { \
+    (r).buf |= get64((r).base + (r).pos) << (r).n; \
+    (r).pos += (63 - (r).n) >> 3; \
+    (r).n |= 56; \
+  } while (0)
+
+/* Near the end of a stream: a byte at a time, zeros past the end. */
+static inline void
+refill_tail(BitReader *r)
+{
+  for (; r->n <= 56; r->n += 8, r->pos++)
+    if (r->pos < r->size)
+      r->buf |= (uint64_t)r->base[r->pos] << r->n;
+}
+
+#define DECODE(t, r, o) \
+  do { \
+    HuffDecEntry const *e_ = &(t)[(r).buf & ((1u << HUFF_CODEC_BITS) - 1)]; \
+    memcpy((o), e_->sym, 4); \
+    (o) += e_->count; \
+    (r).buf >>= e_->bits; \
+    (r).n -= e_->bits; \
+  } while (0)
+
+int
+huff_decode(HuffDecoder const *d, void const *src, size_t src_len, void *dst, size_t n)
+{
+  HuffDecEntry const *t = d->table;
+  uint8_t const *in = src;
+  uint8_t *out = dst;
+  size_t seg = n / 4;
+  uint64_t sizes[4], used = 0;
+  BitReader r[4];
+  uint8_t *o[4], *o_end[4];
+
+  if (src_len < HEADER_SIZE)
+    return -1;
+  for (int k = 0; k < 3; k++)
+  {
+    sizes[k] = get32(in + 4 * k);
+    used += sizes[k];
+  }
+  if (used > src_len - HEADER_SIZE)
+    return -1;
+  sizes[3] = src_len - HEADER_SIZE - used;
+
+  in += HEADER_SIZE;
+  for (int k = 0; k < 4; k++)
+  {
+    r[k] = (BitReader){ .base = in, .size = (size_t)sizes[k] };
+    in += sizes[k];
+    o[k] = out + k * seg;
+    o_end[k] = k < 3 ? o[k] + seg : out + n;
+  }
+
+  /*
+   * Four streams in lockstep: each round refills every reader once and
+   * then does five table lookups per stream (5 x 11 bits fit the 56
+   * guaranteed), each writing four bytes and keeping however many of
+   * them it decoded. Stop while every stream still has the input for a
+   * full refill and room for the over-writes. As in the encoder, the
+   * loops are unrolled to keep the readers out of memory.
+   */
+  for (;;)
+  {
+    bool room = true;
+
+#pragma GCC unroll 4
+    for (int k = 0; k < 4; k++)
+      room &= r[k].pos + 8 <= r[k].size && o_end[k] - o[k] >= 20;
+    if (!room)
+      break;
+
+#pragma GCC unroll 4
+    for (int k = 0; k < 4; k++)
+      REFILL(r[k]);
+#pragma GCC unroll 5
+    for (int j = 0; j < 5; j++)
+#pragma GCC unroll 4
+      for (int k = 0; k < 4; k++)
+        DECODE(t, r[k], o[k]);
+  }
+
+  /* Each stream's tail one symbol at a time, to land exactly on its end. */
+  for (int k = 0; k < 4; k++)
+  {
+    while (o[k] < o_end[k])
+    {
+      if (r[k].n < HUFF_CODEC_BITS)
+        refill_tail(&r[k]);
+
+      HuffDecEntry const *e = &t[r[k].buf & ((1u << HUFF_CODEC_BITS) - 1)];
+      *o[k]++ = e->sym[0];
+      r[k].buf >>= e->first_len;
+      r[k].n -= e->first_len;
+    }
+
+    /* The stream must end in the byte holding its last code. */
+    uint64_t consumed = (uint64_t)r[k].pos * 8 - r[k].n;
+    if ((consumed + 7) / 8 != r[k].size)
+      return -1;
+  }
+
+  return 0;
+}
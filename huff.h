@@ -0,0 +1,104 @@
+#ifndef __huff_h__
+#define __huff_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Length-limited canonical Huffman codes over bytes.
+ *
+ *   uint8_t len[256];
+ *   uint16_t code[256];
+ *   huff_lengths(counts, 11, len);
+ *   huff_codes(len, code);
+ *
+ * Lengths come from package-merge, so they are optimal for the limit.
+ * Codes are canonical: shorter codes first, ties by symbol, which means
+ * the lengths alone describe the code. Everything is O(n * max_bits) on
+ * the stack, cheap enough to rebuild for every block of an adaptive
+ * compressor.
+ *
+ * Bitstreams are LSB-first, as in deflate: HuffEnc holds each code
+ * bit-reversed so it can be OR-ed into a bit buffer, and the decode
+ * table is indexed by the next table_bits bits of such a buffer.
+ */
+
+#define HUFF_MAX_BITS 15
+
+typedef struct HuffEnc_s {
+  uint16_t bits;
+  uint8_t len;
+} HuffEnc;
+
+/* A decode table entry: the symbol in the low byte, its length above. */
+#define HUFF_DEC_SYM(e) ((uint8_t)(e))
+#define HUFF_DEC_LEN(e) ((unsigned)(e) >> 8)
+
+/* Code lengths for counts, none longer than max_bits; unused symbols get
+ * 0. A lone symbol still gets a 1-bit code. Returns -1 if max_bits is
+ * above HUFF_MAX_BITS or too short for the number of symbols in use. */
+int huff_lengths(uint64_t const counts[256], unsigned max_bits, uint8_t lengths[256]);
+
+/* Canonical codes, MSB-first, for lengths. Returns -1 if the lengths
+ * oversubscribe the code space. */
+int huff_codes(uint8_t const lengths[256], uint16_t codes[256]);
+
+void huff_enc_table(uint8_t const lengths[256], uint16_t const codes[256], HuffEnc enc[256]);
+
+/* Fills the 1 << table_bits entries of dec; table_bits must be at least
+ * the longest length. Returns -1 if it is not. */
+int huff_dec_table(uint8_t const lengths[256], uint16_t const codes[256],
+                   unsigned table_bits, uint16_t *dec);
+
+/*
+ * Block codec. The input is split into four equal segments (the last
+ * takes the remainder), each coded into its own bitstream so a decoder
+ * can run four independent dependency chains at once. A block is
+ *
+ *   u32 size0, size1, size2 (little-endian), stream 0 .. stream 3
+ *
+ * with the fourth stream's size implied by the block size. Codes may be
+ * at most HUFF_CODEC_BITS long, so that a decoder table of multi-symbol
+ * entries fits in L1; build them with huff_lengths(counts,
+ * HUFF_CODEC_BITS, ...) or less. The code lengths themselves travel
+ * separately, e.g. packed with huff_pack_lengths().
+ */
+#define HUFF_CODEC_BITS 11
+#define HUFF_LENGTHS_SIZE 128
+
+/* One lookup in the multi-symbol table: as many whole codes as fit in
+ * the next HUFF_CODEC_BITS bits, up to four, and how far they go. The
+ * first symbol's own length is kept for the exact tail of a stream. */
+typedef struct HuffDecEntry_s {
+  uint8_t sym[4];
+  uint8_t bits;
+  uint8_t count;
+  uint8_t first_len;
+  uint8_t pad;
+} HuffDecEntry;
+
+typedef struct HuffDecoder_s {
+  HuffDecEntry table[1 << HUFF_CODEC_BITS];
+} HuffDecoder;
+
+void huff_pack_lengths(uint8_t const lengths[256], uint8_t out[HUFF_LENGTHS_SIZE]);
+void huff_unpack_lengths(uint8_t const in[HUFF_LENGTHS_SIZE], uint8_t lengths[256]);
+
+/* Largest block huff_encode() can produce for n bytes. */
+size_t huff_bound(size_t n);
+
+/* Codes src[0..n) into dst, which holds at least huff_bound(n) bytes;
+ * every byte in src must have a code. Returns the block size. */
+size_t huff_encode(HuffEnc const enc[256], void const *src, size_t n, void *dst);
+
+/* Returns -1 if a length is above HUFF_CODEC_BITS or they oversubscribe
+ * the code space. */
+int huff_decoder_init(HuffDecoder *d, uint8_t const lengths[256]);
+
+/* Decodes a block of size src_len into n bytes. The block does not
+ * record n, so the caller must pass the exact count it was encoded
+ * with; a wrong n is not reliably detected. Returns -1 if a stream does
+ * not end in the byte holding its last code. */
+int huff_decode(HuffDecoder const *d, void const *src, size_t src_len, void *dst, size_t n);
+
+#endif /* !defined(__huff_h__) */
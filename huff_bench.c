@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "corpus.h"
+#include "hstat.h"
+#include "huff.h"
+
+#define MAX_REPS 1000
+#define BENCH_SEED 0x68657873746174
+
+/* A corpus cut into blocks, each coded with its own length-limited code
+ * as an adaptive compressor would. */
+typedef struct Coded_s {
+  size_t block;
+  size_t n_blocks;
+  uint8_t (*lengths)[HUFF_LENGTHS_SIZE];
+  size_t *offs;
+  size_t *sizes;
+  uint8_t *data;
+} Coded;
+
+static bool first_result = true;
+
+/* Everything a block costs the compressor: histogram, code, tables and
+ * the encode itself. */
+static int
+encode(Coded *c, uint8_t const *buf, size_t size)
+{
+  size_t at = 0;
+
+  for (size_t b = 0; b < c->n_blocks; b++)
+  {
+    uint8_t const *p = buf + b * c->block;
+    size_t n = size - b * c->block < c->block ? size - b * c->block : c->block;
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    HuffEnc enc[256];
+    HsHist h;
+
+    hs_init(&h);
+    hs_update(&h, p, n);
+    if (huff_lengths(h.counts, HUFF_CODEC_BITS, lengths) == -1
+        || huff_codes(lengths, codes) == -1)
+      return -1;
+    huff_enc_table(lengths, codes, enc);
+    huff_pack_lengths(lengths, c->lengths[b]);
+
+    c->offs[b] = at;
+    c->sizes[b] = huff_encode(enc, p, n, c->data + at);
+    at += c->sizes[b];
+  }
+  return 0;
+}
+
+static int
+decode(Coded const *c, uint8_t *out, size_t size)
+{
+  static HuffDecoder d;
+
+  for (size_t b = 0; b < c->n_blocks; b++)
+  {
+    size_t n = size - b * c->block < c->block ? size - b * c->block : c->block;
+    uint8_t lengths[256];
+
+    huff_unpack_lengths(c->lengths[b], lengths);
+    if (huff_decoder_init(&d, lengths) == -1
+        || huff_decode(&d, c->data + c->offs[b], c->sizes[b], out + b * c->block, n) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Both directions on one thread, so MB/s is per core. */
+static int
+bench(char const *corpus, uint8_t const *buf, uint8_t *out, size_t size,
+      Coded *c, int reps)
+{
+  double enc_mbps[MAX_REPS], dec_mbps[MAX_REPS];
+  char const *error = NULL;
+  size_t coded = 0;
+
+  for (int r = 0; r < reps && !error; r++)
+  {
+    double t = bench_now_ns();
+    if (encode(c, buf, size) == -1)
+      error = "no code for block";
+    enc_mbps[r] = (double)size / (bench_now_ns() - t) * 1e3;
+
+    memset(out, 0, size);
+    t = bench_now_ns();
+    if (!error && decode(c, out, size) == -1)
+      error = "decode failed";
+    dec_mbps[r] = (double)size / (bench_now_ns() - t) * 1e3;
+
+    if (!error && memcmp(buf, out, size))
+      error = "round trip mismatch";
+  }
+
+  for (size_t b = 0; b < c->n_blocks; b++)
+    coded += HUFF_LENGTHS_SIZE + c->sizes[b];
+
+  printf("%s\n    {\"corpus\": \"%s\", \"size\": %zu, \"block\": %zu, ",
+         first_result ? "" : ",", corpus, size, c->block);
+  first_result = false;
+  if (error) {
+    printf("\"error\": \"%s\"}", error);
+    fflush(stdout);
+    return -1;
+  }
+
+  BenchStats e = bench_stats(enc_mbps, reps), d = bench_stats(dec_mbps, reps);
+  printf("\"reps\": %d, \"coded\": %zu, \"ratio\": %.4f, ", reps, coded,
+         (double)coded / (double)size);
+  bench_print_stats("encode_mbps", &e, 1);
+  printf(", ");
+  bench_print_stats("decode_mbps", &d, 1);
+  printf("}");
+  fflush(stdout);
+  return 0;
+}
+
+static void
+usage(char const *argv0)
+{
+  fprintf(stderr, "usage: %s [-m size] [-b block] [-r reps] [-c corpus,...]\n", argv0);
+  fprintf(stderr, "corpora:");
+  for (size_t i = 0; i < corpus_count(); i++)
+    fprintf(stderr, " %s", corpus_name(i));
+  fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t size = (size_t)64 << 20;
+  size_t block = (size_t)128 << 10;
+  int reps = 7;
+  char const *corpora = NULL;
+  uint8_t *buf, *out;
+  Coded c;
+  int rc = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:b:r:c:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'm':
+        if (bench_parse_size(optarg, &size) == -1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'b':
+        if (bench_parse_size(optarg, &block) == -1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'c':
+        corpora = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (reps < 1 || reps > MAX_REPS || block > UINT32_MAX) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (block > size)
+    block = size;
+
+  c.block = block;
+  c.n_blocks = (size + block - 1) / block;
+  c.lengths = malloc(c.n_blocks * sizeof(*c.lengths));
+  c.offs = malloc(c.n_blocks * sizeof(*c.offs));
+  c.sizes = malloc(c.n_blocks * sizeof(*c.sizes));
+  c.data = malloc(c.n_blocks * huff_bound(block) + huff_bound(size % block));
+  buf = malloc(size);
+  out = malloc(size);
+  if (!c.lengths || !c.offs || !c.sizes || !c.data || !buf || !out) {
+    perror("malloc");
+    return 1;
+  }
+
+  printf("{\n  \"host\": {\"cpus\": %ld},\n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  \"config\": {\"size\": %zu, \"block\": %zu, \"reps\": %d, "
+         "\"code_bits\": %d},\n", size, block, reps, HUFF_CODEC_BITS);
+  printf("  \"results\": [");
+
+  for (size_t i = 0; i < corpus_count(); i++)
+  {
+    char const *corpus = corpus_name(i);
+
+    if (!bench_listed(corpora, corpus))
+      continue;
+    if (corpus_fill(i, buf, size, BENCH_SEED) == -1) {
+      fprintf(stderr, "%s: cannot generate corpus\n", corpus);
+      return 1;
+    }
+    if (bench(corpus, buf, out, size, &c, reps) == -1)
+      rc = 1;
+  }
+
+  printf("\n  ]\n}\n");
+  free(c.lengths);
+  free(c.offs);
+  free(c.sizes);
+  free(c.data);
+  free(buf);
+  free(out);
+  return rc;
+}
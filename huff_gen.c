@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hstat.h"
+#include "huff.h"
+
+#define READ_SIZE ((size_t)1 << 20)
+
+/* Histogram from hex_stats output: only the "[byte] : count" lines are
+ * read, so headers and anything else around them are ignored. */
+static int
+read_stats(FILE *in, char const *name, uint64_t counts[256])
+{
+  char line[256];
+  int n_lines = 0;
+
+  while (fgets(line, sizeof(line), in))
+  {
+    int b;
+    uint64_t c;
+
+    if (sscanf(line, " [%d] : %" SCNu64, &b, &c) != 2)
+      continue;
+    if (b < 0 || b > 255) {
+      fprintf(stderr, "%s: byte %d out of range\n", name, b);
+      return -1;
+    }
+    counts[b] += c;
+    n_lines++;
+  }
+
+  if (ferror(in)) {
+    perror(name);
+    return -1;
+  }
+  if (n_lines == 0) {
+    fprintf(stderr, "%s: no histogram found\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+/* Histogram of the raw bytes of a file. */
+static int
+count_file(int fd, char const *name, HsHist *h)
+{
+  uint8_t *buf = malloc(READ_SIZE);
+  ssize_t r;
+  int rc = 0;
+
+  if (!buf) {
+    perror("malloc");
+    return -1;
+  }
+  while ((r = read(fd, buf, READ_SIZE)) != 0)
+  {
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1 || hs_update(h, buf, (size_t)r) == -1) {
+      perror(name);
+      rc = -1;
+      break;
+    }
+  }
+  free(buf);
+  return rc;
+}
+
+static int
+load(char const *path, bool stats, uint64_t counts[256], HsHist *h)
+{
+  bool std = !strcmp(path, "-");
+  int rc;
+
+  if (stats) {
+    FILE *in = std ? stdin : fopen(path, "r");
+    if (!in) {
+      perror(path);
+      return -1;
+    }
+    rc = read_stats(in, std ? "stdin" : path, counts);
+    if (!std)
+      fclose(in);
+    return rc;
+  }
+
+  int fd = std ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
+  rc = count_file(fd, std ? "stdin" : path, h);
+  if (!std)
+    close(fd);
+  return rc;
+}
+
+static void
+print_code(uint64_t const counts[256], uint8_t const lengths[256], uint16_t const codes[256])
+{
+  uint64_t total = 0, bits = 0;
+
+  for (int s = 0; s < 256; s++)
+  {
+    total += counts[s];
+    bits += counts[s] * lengths[s];
+  }
+
+  printf("Huffman Code:\n");
+  for (int s = 0; s < 256; s++)
+  {
+    if (!lengths[s])
+      continue;
+    printf("\t[%d] : %"PRIu64" %u ", s, counts[s], lengths[s]);
+    for (int i = lengths[s]; i-- > 0; )
+      putchar('0' + (codes[s] >> i & 1));
+    putchar('\n');
+  }
+  if (total)
+    printf("%"PRIu64" bytes -> %"PRIu64" bits (%.4f bits/byte)\n", total, bits,
+           (double)bits / (double)total);
+}
+
+static void
+print_array(char const *type, char const *name, char const *suffix, char const *size,
+            unsigned const *v, size_t n)
+{
+  printf("static %s const %s_%s[%s] = {", type, name, suffix, size);
+  for (size_t i = 0; i < n; i++)
+    printf("%s%u,", i % 12 ? " " : "\n  ", v[i]);
+  printf("\n};\n\n");
+}
+
+/* C tables for table-driven coding; see huff.h for the bit order. */
+static void
+print_tables(char const *name, unsigned max_bits, uint8_t const lengths[256],
+             uint16_t const codes[256], uint16_t const *dec)
+{
+  static unsigned v[1 << HUFF_MAX_BITS];
+  HuffEnc enc[256];
+  char macro[64];
+  char size[80];
+  size_t i;
+
+  for (i = 0; name[i] && i < sizeof(macro) - 1; i++)
+    macro[i] = (char)toupper((unsigned char)name[i]);
+  macro[i] = '\0';
+
+  huff_enc_table(lengths, codes, enc);
+
+  printf("/* Generated by huff_gen: length-limited canonical Huffman code.\n"
+         " * Codes are bit-reversed for LSB-first bit buffers; a decode entry is\n"
+         " * symbol | length << 8, indexed by the next %s_BITS bits. */\n\n",
+         macro);
+  printf("#define %s_BITS %u\n\n", macro, max_bits);
+
+  for (i = 0; i < 256; i++)
+    v[i] = lengths[i];
+  print_array("uint8_t", name, "len", "256", v, 256);
+  for (i = 0; i < 256; i++)
+    v[i] = enc[i].bits;
+  print_array("uint16_t", name, "code", "256", v, 256);
+
+  snprintf(size, sizeof(size), "1 << %s_BITS", macro);
+  for (i = 0; i < (size_t)1 << max_bits; i++)
+    v[i] = dec[i];
+  print_array("uint16_t", name, "dec", size, v, (size_t)1 << max_bits);
+}
+
+/* How long a full rebuild takes: lengths, codes and both tables. */
+static void
+time_rebuild(uint64_t const counts[256], unsigned max_bits, long reps)
+{
+  static uint16_t dec[1 << HUFF_MAX_BITS];
+  uint8_t lengths[256];
+  uint16_t codes[256];
+  HuffEnc enc[256];
+  struct timespec t0, t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (long i = 0; i < reps; i++)
+  {
+    huff_lengths(counts, max_bits, lengths);
+    huff_codes(lengths, codes);
+    huff_enc_table(lengths, codes, enc);
+    huff_dec_table(lengths, codes, max_bits, dec);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double ns = (double)(t1.tv_sec - t0.tv_sec) * 1e9 + (double)(t1.tv_nsec - t0.tv_nsec);
+  fprintf(stderr, "rebuild: %.0f ns (%ld reps)\n", ns / (double)reps, reps);
+}
+
+/* The names print_tables() emits are built from this, so it must be a
+ * C identifier. */
+static bool
+is_identifier(char const *s)
+{
+  if (!isalpha((unsigned char)*s) && *s != '_')
+    return false;
+  for (; *s; s++)
+    if (!isalnum((unsigned char)*s) && *s != '_')
+      return false;
+  return true;
+}
+
+static void
+usage(char const *argv0)
+{
+  fprintf(stderr, "usage: %s [-L max-bits] [-s] [-c name] [-T reps] [path...]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static uint16_t dec[1 << HUFF_MAX_BITS];
+  unsigned long max_bits = 11;
+  bool stats = false;
+  char const *name = NULL;
+  long reps = 0;
+  uint64_t counts[256] = { 0 };
+  uint8_t lengths[256];
+  uint16_t codes[256];
+  HsHist h;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "L:sc:T:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'L':
+        max_bits = strtoul(optarg, NULL, 10);
+        break;
+
+      case 's':
+        stats = true;
+        break;
+
+      case 'c':
+        name = optarg;
+        break;
+
+      case 'T':
+        reps = strtol(optarg, NULL, 10);
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (max_bits < 1 || max_bits > HUFF_MAX_BITS) {
+    fprintf(stderr, "max bits must be between 1 and %d\n", HUFF_MAX_BITS);
+    return 1;
+  }
+  if (name && !is_identifier(name)) {
+    fprintf(stderr, "'%s' is not a C identifier\n", name);
+    return 1;
+  }
+
+  /* Paths are raw data to count, or with -s hex_stats output. */
+  hs_init(&h);
+  if (optind == argc && load("-", stats, counts, &h) == -1)
+    return 1;
+  for (int i = optind; i < argc; i++)
+    if (load(argv[i], stats, counts, &h) == -1)
+      return 1;
+  for (int b = 0; b < 256; b++)
+    counts[b] += h.counts[b];
+
+  if (huff_lengths(counts, (unsigned)max_bits, lengths) == -1) {
+    fprintf(stderr, "no code within %lu bits for this histogram\n", max_bits);
+    return 1;
+  }
+  if (huff_codes(lengths, codes) == -1
+      || huff_dec_table(lengths, codes, (unsigned)max_bits, dec) == -1) {
+    fprintf(stderr, "internal error: bad code lengths\n");
+    return 1;
+  }
+
+  if (name)
+    print_tables(name, (unsigned)max_bits, lengths, codes, dec);
+  else
+    print_code(counts, lengths, codes);
+
+  if (reps > 0)
+    time_rebuild(counts, (unsigned)max_bits, reps);
+
+  return 0;
+}
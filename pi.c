@@ -0,0 +1,818 @@
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "pi.h"
+#include "sieve.h"
+
+/*
+ * With y >= x^(1/3), a = pi(y) and z = x / y,
+ *
+ *   pi(x) = phi(x, a) + a - 1 - P2,
+ *   P2    = sum over y < p <= sqrt(x) of pi(x / p) - pi(p) + 1,
+ *   phi(x, a) = S0 + S2,
+ *   S0    = sum over n <= y with no factor below p_(c+1) of
+ *           mu(n) phi(x / n, c),
+ *   S2    = -sum over c <= b < a, over squarefree m in (y / p, y] with
+ *           no factor up to p = p_(b+1), of mu(m) phi(x / (p m), b).
+ *
+ * S0 is read off a table of phi(., c). The special leaves of S2 all lie
+ * below z, and so do the pi(x / p) of P2: both are evaluated in one
+ * pass of a segmented sieve over [0, z], which crosses off one prime
+ * at a time and answers phi(v, b) for every leaf v of b in the segment
+ * in between. Leaves with v below p_(b+1)^2 need no sieving past the
+ * square root of the segment's end, only pi(v), and those with v below
+ * p_(b+1) are 1 and counted in bulk.
+ *
+ * The sieve runs on the mod-30 wheel of sieve.h with 7, 11 and 13
+ * presieved, hence c = 6. Threads take chunks of segments and count
+ * from zero; the chunks' totals are stitched together in order at the
+ * end. Every sum is kept modulo 2^64, which is exact because pi(x)
+ * fits.
+ */
+#define PHI_C 6
+#define PHI_PRIMORIAL 30030
+#define PHI_TOTIENT 5760
+
+/* Below this, count with a plain sieve. */
+#define SMALL_LIMIT 10000000
+
+/* Unsieved numbers are counted per 256-byte block of a segment, so a
+ * leaf costs at most a block's worth of popcounts on top of the block
+ * totals from the previous leaf. */
+#define BLOCK_SHIFT 8
+#define BLOCK_BYTES ((size_t)1 << BLOCK_SHIFT)
+
+#define CHUNKS_PER_THREAD 8
+
+/* pi(2^64). */
+#define PI_MAX 425656284035217743
+
+/* One chunk's share of the sum; prefix terms are left as weights. */
+typedef struct LmoChunk_s {
+  uint64_t sum;
+  uint64_t *left;      /* [b - c]: numbers left after sieving b primes */
+  uint64_t *weight;    /* [b - c]: times phi(chunk start - 1, b) is due */
+} LmoChunk;
+
+typedef struct Lmo_s {
+  uint64_t x, y, z;
+  uint32_t *primes;    /* up to max(y, sqrt(x)), from 2 */
+  size_t n_primes;
+  size_t a;            /* pi(y) */
+  size_t b_sieve;      /* pi(sqrt(z)): sieve this far, then read pi */
+  size_t b_composite;  /* below this, m may be composite */
+  size_t n_root;       /* pi(sqrt(x)) */
+  int32_t *mu_lpf;     /* mu(m) lpf(m) for m <= y */
+  uint32_t *m_stop;    /* for each b, leaves have m above this */
+  size_t seg_bytes;
+  uint64_t end_byte;   /* the sieve covers [0, 30 end_byte) */
+  uint64_t chunk_bytes;
+  uint64_t n_chunks;
+  LmoChunk *chunks;
+  atomic_uint_fast64_t next;
+} Lmo;
+
+typedef struct LmoWorker_s {
+  Lmo *l;
+  uint8_t *seg;
+  uint32_t *block;     /* unsieved numbers per block */
+  uint32_t *before;    /* unsieved numbers before each word */
+  uint64_t *offs;      /* sieving primes' next multiples */
+  uint8_t *wheel;
+  size_t active;
+  uint32_t *cursor;    /* for each b: m, or the count of primes to m */
+  size_t root_cursor;  /* count of primes to P2's next p */
+} LmoWorker;
+
+static uint16_t phi_c[PHI_PRIMORIAL];
+static once_flag phi_c_once = ONCE_FLAG_INIT;
+
+static void
+phi_c_init (void)
+{
+  uint16_t n = 0;
+
+  for (unsigned k = 0; k < PHI_PRIMORIAL; k++)
+  {
+    if (k % 2 && k % 3 && k % 5 && k % 7 && k % 11 && k % 13)
+      n++;
+    phi_c[k] = n;
+  }
+}
+
+static uint64_t
+phi_small (uint64_t n)
+{
+  return n / PHI_PRIMORIAL * PHI_TOTIENT + phi_c[n % PHI_PRIMORIAL];
+}
+
+/* The number of primes up to n, for n within the table. */
+static size_t
+pi_table (Lmo const *l, uint64_t n)
+{
+  size_t lo = 0, hi = l->n_primes;
+
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (l->primes[mid] <= n)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static uint64_t
+icbrt (uint64_t n)
+{
+  uint64_t r = (uint64_t)cbrtl((long double)n);
+
+  while (r > 0 && r * r * r > n)
+    r--;
+  while ((r + 1) * (r + 1) * (r + 1) <= n)
+    r++;
+  return r;
+}
+
+/* y = alpha x^(1/3) trades the leaves, which grow as y, against the
+ * sieve, which spans x / y; alpha grows slowly with x. */
+static uint64_t
+choose_y (uint64_t x)
+{
+  double lx = log((double)x);
+  double alpha = lx * lx / 400;
+  uint64_t root = sieve_isqrt(x), y = icbrt(x) + 1;
+
+  if (alpha > 1)
+    y = (uint64_t)((double)y * alpha);
+  return y < root ? y : root;
+}
+
+/* mu(m) lpf(m), 0 if m is not squarefree, with lpf(1) = INT32_MAX. */
+static int32_t *
+mu_lpf_table (uint32_t const *primes, size_t n_primes, uint64_t y)
+{
+  int32_t *t = malloc((y + 1) * sizeof(*t));
+
+  if (!t)
+    return NULL;
+  for (uint64_t m = 0; m <= y; m++)
+    t[m] = INT32_MAX;
+  for (size_t i = n_primes; i-- > 0; )
+  {
+    uint64_t p = primes[i];
+
+    if (p > y)
+      continue;
+    for (uint64_t m = p; m <= y; m += p)
+      t[m] = t[m] == 0 ? 0 : t[m] > 0 ? -(int32_t)p : (int32_t)p;
+    for (uint64_t m = p * p; m <= y; m += p * p)
+      t[m] = 0;
+  }
+  return t;
+}
+
+/* Clears the bit for n, which the segment holds; returns whether it
+ * was set. */
+static unsigned
+clear_one (LmoWorker *w, uint64_t base, uint64_t n)
+{
+  size_t i = (size_t)(n / 30 - base);
+  int k = sieve_class[n % 30];
+  unsigned bit = k < 0 ? 0 : w->seg[i] >> k & 1;
+
+  w->seg[i] &= (uint8_t)~(bit << k);
+  w->block[i >> BLOCK_SHIFT] -= bit;
+  return bit;
+}
+
+/* Crosses off the multiples of sieving prime j in a segment of n bytes,
+ * keeping the block counts; returns how many were still there. */
+static uint64_t
+cross_off (LmoWorker *w, uint64_t p, size_t j, uint64_t n)
+{
+  uint8_t *seg = w->seg;
+  uint32_t *block = w->block;
+  uint64_t q = p / 30, idx = w->offs[j], gone = 0;
+  unsigned wi = w->wheel[j];
+
+  if (p <= n && idx <= n - p) {
+    uint64_t o[8];
+    uint8_t c[8], k[8];
+    unsigned s = wi;
+
+    for (uint64_t t = 0, at = 0; t < 8; t++)
+    {
+      o[t] = at;
+      c[t] = sieve_steps[s].clear;
+      k[t] = (uint8_t)__builtin_ctz(~sieve_steps[s].clear & 0xffu);
+      at += q * sieve_steps[s].dq + sieve_steps[s].dc;
+      s = sieve_steps[s].next;
+    }
+    for (; idx <= n - p; idx += p)
+    {
+#pragma GCC unroll 8
+      for (int t = 0; t < 8; t++)
+      {
+        uint64_t at = idx + o[t];
+        unsigned bit = seg[at] >> k[t] & 1;
+
+        block[at >> BLOCK_SHIFT] -= bit;
+        gone += bit;
+        seg[at] &= c[t];
+      }
+    }
+  }
+
+  while (idx < n)
+  {
+    SieveStep const *e = &sieve_steps[wi];
+    unsigned bit = (seg[idx] & (uint8_t)~e->clear) != 0;
+
+    block[idx >> BLOCK_SHIFT] -= bit;
+    gone += bit;
+    seg[idx] &= e->clear;
+    idx += q * e->dq + e->dc;
+    wi = e->next;
+  }
+
+  w->offs[j] = idx - n;
+  w->wheel[j] = (uint8_t)wi;
+  return gone;
+}
+
+/* The bits of the word holding byte i up to the number v in it. */
+static uint64_t
+upto_mask (size_t i, uint64_t v)
+{
+  unsigned sh = 8 * (unsigned)(i % 8);
+
+  return (((uint64_t)1 << sh) - 1) | (uint64_t)sieve_upto[v % 30] << sh;
+}
+
+/* Unsieved numbers in the segment up to v, walking the block counts on
+ * from the previous, smaller v of the same prime. */
+static uint64_t
+count_to (LmoWorker const *w, uint64_t base, uint64_t v, size_t *blk, uint64_t *below)
+{
+  size_t i = (size_t)(v / 30 - base), b = i >> BLOCK_SHIFT;
+  uint64_t n;
+
+  while (*blk < b)
+    *below += w->block[(*blk)++];
+  n = *below;
+  for (size_t at = b << BLOCK_SHIFT; at + 8 <= (i & ~(size_t)7); at += 8)
+    n += (uint64_t)__builtin_popcountll(sieve_word(w->seg, at));
+  return n + (uint64_t)__builtin_popcountll(sieve_word(w->seg, i & ~(size_t)7) & upto_mask(i, v));
+}
+
+/* The same once the segment is done sieving, from the word counts. */
+static uint64_t
+count_sieved (LmoWorker const *w, uint64_t base, uint64_t v)
+{
+  size_t i = (size_t)(v / 30 - base);
+
+  return w->before[i / 8]
+         + (uint64_t)__builtin_popcountll(sieve_word(w->seg, i & ~(size_t)7) & upto_mask(i, v));
+}
+
+/* The next of b's leaves with v below hi, in increasing order of v: m
+ * decreases, over the squarefree numbers free of primes up to p while
+ * m may be composite, over the primes after that. The sign is -mu(m),
+ * so leaves of prime m add phi(v, b) to S2. */
+static inline bool
+next_leaf (Lmo const *l, size_t b, uint32_t *at, uint64_t xp, uint64_t hi,
+           uint64_t *v, bool *plus)
+{
+  uint64_t m = *at, stop = l->m_stop[b];
+
+  if (b < l->b_composite) {
+    int32_t e = 0;
+
+    for (; m > stop; m--)
+    {
+      e = l->mu_lpf[m];
+      if (e != 0 && (uint64_t)(e < 0 ? -(int64_t)e : e) > l->primes[b])
+        break;
+    }
+    *at = (uint32_t)m;
+    if (m <= stop || xp / m >= hi)
+      return false;
+    *v = xp / m;
+    *plus = e < 0;
+  } else {
+    if (m <= stop || xp / l->primes[m - 1] >= hi)
+      return false;
+    *v = xp / l->primes[m - 1];
+    *plus = true;
+  }
+  *at = (uint32_t)(m - 1);
+  return true;
+}
+
+/* Sieves the segment of n bytes from byte base and evaluates its
+ * leaves into ch. */
+static void
+segment (LmoWorker *w, uint64_t base, size_t n, LmoChunk *ch)
+{
+  Lmo const *l = w->l;
+  uint64_t lo = 30 * base, hi = 30 * (base + n), left = 0;
+  size_t n_blocks = (n + BLOCK_BYTES - 1) >> BLOCK_SHIFT, b;
+  uint64_t sum = ch->sum, weight_sieved = 0, sieved;
+  uint64_t p_sieve = l->primes[l->b_sieve - 1], v;
+  bool plus;
+
+  for (size_t at = 0, from = (size_t)(base % SIEVE_PRESIEVE_BYTES); at < n; )
+  {
+    size_t k = SIEVE_PRESIEVE_BYTES - from < n - at ? SIEVE_PRESIEVE_BYTES - from : n - at;
+    memcpy(w->seg + at, sieve_presieve + from, k);
+    at += k;
+    from = 0;
+  }
+  memset(w->seg + n, 0, (n_blocks << BLOCK_SHIFT) - n + 8);
+  for (size_t k = 0; k < n_blocks; k++)
+  {
+    uint32_t c = 0;
+    for (size_t at = k << BLOCK_SHIFT; at < (k + 1) << BLOCK_SHIFT; at += 8)
+      c += (uint32_t)__builtin_popcountll(sieve_word(w->seg, at));
+    w->block[k] = c;
+    left += c;
+  }
+
+  /* Primes whose square is below hi: the leaves of b read phi(v, b)
+   * between crossing off p_b and p_(b+1). */
+  for (b = PHI_C; b < l->b_sieve; b++)
+  {
+    uint64_t p = l->primes[b];
+    size_t blk = 0;
+    uint64_t below = ch->left[b - PHI_C];   /* from earlier segments */
+
+    if (p * p >= hi)
+      break;
+    ch->left[b - PHI_C] += left;
+    while (next_leaf(l, b, &w->cursor[b], l->x / p, hi, &v, &plus))
+    {
+      uint64_t phi = count_to(w, base, v, &blk, &below);
+      sum += plus ? phi : -phi;
+      ch->weight[b - PHI_C] += plus ? 1 : (uint64_t)-1;
+    }
+
+    for (; w->active <= b; w->active++)
+      w->offs[w->active] = sieve_first_multiple(l->primes[w->active], base,
+                                                &w->wheel[w->active]);
+    if (p >= lo)
+      left -= clear_one(w, base, p);
+    left -= cross_off(w, p, b, n);
+  }
+
+  /* Past that, crossing off p takes out only p. */
+  for (size_t c = b; c < l->b_sieve; c++)
+  {
+    uint64_t p = l->primes[c];
+
+    ch->left[c - PHI_C] += left;
+    if (lo <= p && p < hi)
+      left -= clear_one(w, base, p);
+  }
+  sieved = ch->left[l->b_sieve - PHI_C];
+  ch->left[l->b_sieve - PHI_C] += left;
+
+  /* The segment now holds phi(., B), B = b_sieve, and every v left is
+   * below p_(B+1)^2: phi(v, b) = phi(v, B) + min(B, pi(v)) - b, and
+   * pi(v) = phi(v, B) + B - 1 for P2. */
+  for (size_t k = 0, c = 0; k <= (n + 7) / 8; k++)
+  {
+    w->before[k] = (uint32_t)c;
+    if (k < (n + 7) / 8)
+      c += (uint32_t)__builtin_popcountll(sieve_word(w->seg, 8 * k));
+  }
+
+  for (; b < l->a; b++)
+  {
+    while (next_leaf(l, b, &w->cursor[b], l->x / l->primes[b], hi, &v, &plus))
+    {
+      uint64_t pi_v = v < p_sieve ? pi_table(l, v) : l->b_sieve;
+      uint64_t phi = sieved + count_sieved(w, base, v) + pi_v - b;
+      sum += plus ? phi : -phi;
+      weight_sieved += plus ? 1 : (uint64_t)-1;
+    }
+  }
+
+  for (; w->root_cursor > l->a; w->root_cursor--)
+  {
+    uint64_t v = l->x / l->primes[w->root_cursor - 1];
+
+    if (v >= hi)
+      break;
+    sum -= sieved + count_sieved(w, base, v) + l->b_sieve - 1;
+    weight_sieved--;
+  }
+
+  ch->sum = sum;
+  ch->weight[l->b_sieve - PHI_C] += weight_sieved;
+}
+
+/* Points the leaf cursors at the first leaves of v >= lo. */
+static void
+start_chunk (LmoWorker *w, uint64_t lo)
+{
+  Lmo const *l = w->l;
+
+  for (size_t b = PHI_C; b < l->a; b++)
+  {
+    uint64_t p = l->primes[b], t = lo > p ? lo : p;
+    uint64_t m = l->x / p / t;
+
+    if (m > l->y)
+      m = l->y;
+    w->cursor[b] = (uint32_t)(b < l->b_composite ? m : pi_table(l, m));
+  }
+  w->root_cursor = pi_table(l, lo > 0 ? l->x / lo : UINT64_MAX);
+  if (w->root_cursor > l->n_root)
+    w->root_cursor = l->n_root;
+  w->active = PHI_C;
+}
+
+static int
+lmo_worker (void *arg)
+{
+  LmoWorker *w = arg;
+  Lmo *l = w->l;
+  uint64_t c;
+
+  while ((c = atomic_fetch_add(&l->next, 1)) < l->n_chunks)
+  {
+    uint64_t lo = c * l->chunk_bytes;
+    uint64_t hi = l->end_byte - lo <= l->chunk_bytes ? l->end_byte : lo + l->chunk_bytes;
+
+    start_chunk(w, 30 * lo);
+    for (uint64_t base = lo; base < hi; base += l->seg_bytes)
+      segment(w, base, hi - base < l->seg_bytes ? (size_t)(hi - base) : l->seg_bytes,
+              &l->chunks[c]);
+  }
+  return 0;
+}
+
+static void
+worker_free (LmoWorker *w)
+{
+  free(w->seg);
+  free(w->block);
+  free(w->before);
+  free(w->offs);
+  free(w->wheel);
+  free(w->cursor);
+}
+
+static int
+worker_init (LmoWorker *w, Lmo *l)
+{
+  size_t n_blocks = l->seg_bytes >> BLOCK_SHIFT;
+
+  memset(w, 0, sizeof(*w));
+  w->l = l;
+  w->seg = malloc(l->seg_bytes + 8);
+  w->block = malloc(n_blocks * sizeof(*w->block));
+  w->before = malloc((l->seg_bytes / 8 + 1) * sizeof(*w->before));
+  w->offs = malloc(l->b_sieve * sizeof(*w->offs));
+  w->wheel = malloc(l->b_sieve);
+  w->cursor = malloc(l->a * sizeof(*w->cursor));
+  if (!w->seg || !w->block || !w->before || !w->offs || !w->wheel || !w->cursor) {
+    worker_free(w);
+    return -1;
+  }
+  return 0;
+}
+
+/* Runs the chunks on n_threads workers, this thread being one of them. */
+static int
+run (Lmo *l, unsigned n_threads)
+{
+  LmoWorker *workers = calloc(n_threads, sizeof(*workers));
+  unsigned ready = 0;
+
+  if (!workers)
+    return -1;
+  for (; ready < n_threads; ready++)
+    if (worker_init(&workers[ready], l) == -1)
+      break;
+  if (ready > 0)
+    sieve_run(lmo_worker, workers, sizeof(*workers), ready);
+
+  for (unsigned t = 0; t < ready; t++)
+    worker_free(&workers[t]);
+  free(workers);
+  return ready > 0 ? 0 : -1;
+}
+
+static void
+lmo_free (Lmo *l)
+{
+  if (l->chunks)
+    for (uint64_t c = 0; c < l->n_chunks; c++)
+      free(l->chunks[c].left);
+  free(l->chunks);
+  free(l->primes);
+  free(l->mu_lpf);
+  free(l->m_stop);
+}
+
+static int
+lmo_init (Lmo *l, uint64_t x, unsigned n_threads)
+{
+  uint32_t *odd;
+  size_t n_odd, n_weights;
+  uint64_t root = sieve_isqrt(x), n_segments;
+
+  memset(l, 0, sizeof(*l));
+  l->x = x;
+  l->y = choose_y(x);
+  l->z = x / l->y;
+
+  if (sieve_small_primes(l->y > root ? l->y : root, &odd, &n_odd) == -1)
+    return -1;
+  l->primes = malloc((n_odd + 1) * sizeof(*l->primes));
+  if (!l->primes) {
+    free(odd);
+    return -1;
+  }
+  l->primes[0] = 2;
+  memcpy(l->primes + 1, odd, n_odd * sizeof(*odd));
+  l->n_primes = n_odd + 1;
+  free(odd);
+
+  l->a = pi_table(l, l->y);
+  l->b_sieve = pi_table(l, sieve_isqrt(l->z));
+  l->n_root = pi_table(l, root);
+  for (l->b_composite = PHI_C;
+       l->b_composite < l->a
+       && (uint64_t)l->primes[l->b_composite] * l->primes[l->b_composite] < l->y;
+       l->b_composite++)
+    ;
+
+  l->mu_lpf = mu_lpf_table(l->primes, l->n_primes, l->y);
+  l->m_stop = malloc(l->a * sizeof(*l->m_stop));
+  if (!l->mu_lpf || !l->m_stop)
+    return -1;
+  for (size_t b = PHI_C; b < l->a; b++)
+  {
+    uint64_t p = l->primes[b], m = l->y / p > p ? l->y / p : p;
+    size_t j = pi_table(l, l->y / p);
+
+    l->m_stop[b] = (uint32_t)(b < l->b_composite ? m : j > b + 1 ? j : b + 1);
+  }
+
+  l->end_byte = l->z / 30 + 1;
+  l->seg_bytes = SIEVE_MAX_BYTES;
+  while (l->seg_bytes > BLOCK_BYTES && l->seg_bytes / 2 >= l->end_byte)
+    l->seg_bytes /= 2;
+  n_segments = (l->end_byte + l->seg_bytes - 1) / l->seg_bytes;
+  l->n_chunks = (uint64_t)n_threads * CHUNKS_PER_THREAD;
+  if (l->n_chunks > n_segments)
+    l->n_chunks = n_segments;
+  l->chunk_bytes = (n_segments + l->n_chunks - 1) / l->n_chunks * l->seg_bytes;
+  l->n_chunks = (l->end_byte + l->chunk_bytes - 1) / l->chunk_bytes;
+
+  n_weights = l->b_sieve - PHI_C + 1;
+  l->chunks = calloc(l->n_chunks, sizeof(*l->chunks));
+  if (!l->chunks)
+    return -1;
+  for (uint64_t c = 0; c < l->n_chunks; c++)
+  {
+    l->chunks[c].left = calloc(2 * n_weights, sizeof(uint64_t));
+    if (!l->chunks[c].left)
+      return -1;
+    l->chunks[c].weight = l->chunks[c].left + n_weights;
+  }
+  atomic_init(&l->next, 0);
+  return 0;
+}
+
+/* Everything outside the sieve: S0, a - 1, the bulk of trivial leaves
+ * and the pi(p) - 1 of P2. */
+static uint64_t
+lmo_closed_form (Lmo const *l)
+{
+  uint64_t sum = l->a - 1;
+
+  for (uint64_t m = 1; m <= l->y; m++)
+  {
+    int32_t e = l->mu_lpf[m];
+
+    if (e > 13)
+      sum += phi_small(l->x / m);
+    else if (e < -13)
+      sum -= phi_small(l->x / m);
+  }
+
+  /* The leaves with v < p: m prime above x / p^2, phi(v, b) = 1. */
+  for (size_t b = l->b_composite; b < l->a; b++)
+  {
+    uint64_t p = l->primes[b], t = l->x / p / p;
+    size_t first = t < l->y ? pi_table(l, t) : l->a;
+
+    if (first < l->m_stop[b])
+      first = l->m_stop[b];
+    sum += l->a - first;
+  }
+
+  for (uint64_t j = l->a + 1; j <= l->n_root; j++)
+    sum += j - 1;
+  return sum;
+}
+
+static int
+count_small (uint64_t x, uint64_t *count)
+{
+  uint32_t *odd;
+  size_t n_odd;
+
+  if (x < 2) {
+    *count = 0;
+    return 0;
+  }
+  if (sieve_small_primes(x, &odd, &n_odd) == -1)
+    return -1;
+  free(odd);
+  *count = n_odd + 1;
+  return 0;
+}
+
+int
+pi_count (uint64_t x, unsigned n_threads, uint64_t *count)
+{
+  Lmo l;
+  uint64_t *prefix, sum;
+  size_t n_weights;
+
+  if (x < SMALL_LIMIT)
+    return count_small(x, count);
+
+  sieve_tables_init();
+  call_once(&phi_c_once, phi_c_init);
+  if (lmo_init(&l, x, sieve_threads(n_threads)) == -1
+      || run(&l, sieve_threads(n_threads)) == -1) {
+    lmo_free(&l);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  n_weights = l.b_sieve - PHI_C + 1;
+  prefix = calloc(n_weights, sizeof(*prefix));
+  if (!prefix) {
+    lmo_free(&l);
+    return -1;
+  }
+  sum = lmo_closed_form(&l);
+  for (uint64_t c = 0; c < l.n_chunks; c++)
+  {
+    LmoChunk const *ch = &l.chunks[c];
+
+    sum += ch->sum;
+    for (size_t k = 0; k < n_weights; k++)
+    {
+      sum += ch->weight[k] * prefix[k];
+      prefix[k] += ch->left[k];
+    }
+  }
+
+  free(prefix);
+  lmo_free(&l);
+  *count = sum;
+  return 0;
+}
+
+/* li(x) = gamma + ln ln x + sum over k >= 1 of (ln x)^k / (k k!). */
+static long double
+li (long double x)
+{
+  long double l = logl(x), term = 1, sum = 0;
+
+  for (int k = 1; k < 1000; k++)
+  {
+    term *= l / k;
+    sum += term / k;
+    if (k > l && term / k < sum * 1e-20L)
+      break;
+  }
+  return 0.57721566490153286061L + logl(l) + sum;
+}
+
+/* x with li(x) = n, by Newton's method. */
+static long double
+li_inverse (long double n)
+{
+  long double x = n * logl(n);
+
+  for (int i = 0; i < 100; i++)
+  {
+    long double step = (li(x) - n) * logl(x);
+
+    x -= step;
+    if (fabsl(step) < 1)
+      break;
+  }
+  return x;
+}
+
+/* The need-th prime after lo. */
+static int
+sieve_forward (uint64_t lo, uint64_t need, uint64_t *p)
+{
+  uint64_t start = lo + 1;
+
+  for (;;)
+  {
+    long double want = (long double)need * logl((long double)start) * 2 + (1 << 20);
+    uint64_t hi = want < (long double)(UINT64_MAX - start) ? start + (uint64_t)want : UINT64_MAX;
+    uint32_t *primes;
+    size_t n_primes;
+    PrimeSieve s;
+
+    if (sieve_small_primes(sieve_isqrt(hi - 1), &primes, &n_primes) == -1)
+      return -1;
+    if (sieve_init(&s, primes, n_primes, SIEVE_MAX_BYTES) == -1) {
+      free(primes);
+      return -1;
+    }
+
+    sieve_range(&s, start, hi);
+    while (sieve_segment(&s))
+    {
+      uint64_t k = sieve_count(&s);
+
+      if (k < need) {
+        need -= k;
+        continue;
+      }
+      for (size_t at = 0; ; at++)
+      {
+        unsigned bits = s.bytes[at];
+
+        if ((unsigned)__builtin_popcount(bits) < need) {
+          need -= (unsigned)__builtin_popcount(bits);
+          continue;
+        }
+        while (--need > 0)
+          bits &= bits - 1;
+        *p = 30 * (s.seg_base + at) + sieve_residues[__builtin_ctz(bits)];
+        sieve_free(&s);
+        free(primes);
+        return 0;
+      }
+    }
+    sieve_free(&s);
+    free(primes);
+    if (hi == UINT64_MAX) {
+      errno = EDOM;
+      return -1;
+    }
+    start = hi;
+  }
+}
+
+int
+pi_nth (uint64_t n, unsigned n_threads, uint64_t *p)
+{
+  long double x, miss;
+  uint64_t lo, below;
+
+  if (n == 0 || n > PI_MAX) {
+    errno = EDOM;
+    return -1;
+  }
+  if (n == 1) {
+    *p = 2;
+    return 0;
+  }
+  if (n < SMALL_LIMIT / 16) {
+    uint32_t *odd;
+    size_t n_odd;
+
+    if (sieve_small_primes(SMALL_LIMIT, &odd, &n_odd) == -1)
+      return -1;
+    *p = odd[n - 2];
+    free(odd);
+    return 0;
+  }
+
+  /* Start below the estimate by more than pi(x) strays from li(x), if
+   * the Riemann hypothesis holds, then sieve the rest of the way. */
+  x = li_inverse((long double)n);
+  miss = sqrtl(x) * logl(x) * logl(x) / 25;
+  lo = x - miss < (long double)UINT64_MAX ? (uint64_t)(x - miss) : UINT64_MAX;
+  for (;;)
+  {
+    if (pi_count(lo, n_threads, &below) == -1)
+      return -1;
+    if (below < n)
+      break;
+    lo = lo > (uint64_t)miss ? lo - (uint64_t)miss : 0;
+  }
+  return sieve_forward(lo, n - below, p);
+}
@@ -0,0 +1,29 @@
+#ifndef __pi_h__
+#define __pi_h__
+
+#include <stdint.h>
+
+/*
+ * Prime counting without listing the primes.
+ *
+ *   uint64_t n, p;
+ *   pi_count(1000000000000, 0, &n);    n = 37607912018
+ *   pi_nth(n, 0, &p);                  p = 999999999989
+ *
+ * pi_count() is the Lagarias-Miller-Odlyzko method: pi(x) comes from
+ * phi(x, a), the numbers up to x free of the first a primes, expanded
+ * into O(x^(2/3)) leaves that a segmented sieve of [1, x^(2/3)]
+ * evaluates. Time grows as x^(2/3) and memory as x^(1/3) plus sqrt(x)
+ * for the primes P2 needs, so x up to 10^15 or so is practical.
+ *
+ * n_threads is the number of threads to sieve on, this one included;
+ * 0 means one per online CPU. Both return -1 with errno set if memory
+ * or threads run out, or if there is no such prime below 2^64.
+ */
+
+int pi_count(uint64_t x, unsigned n_threads, uint64_t *count);
+
+/* The n-th prime, counting 2 as the first. */
+int pi_nth(uint64_t n, unsigned n_threads, uint64_t *p);
+
+#endif /* !defined(__pi_h__) */
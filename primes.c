@@ -0,0 +1,1180 @@
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <math.h>
+#include <threads.h>
+#include "primes.h"
+
+__extension__ typedef unsigned __int128 u128;
+
+/* Montgomery arithmetic modulo an odd n with R = 2^64. */
+typedef struct Mont_s {
+  uint64_t n;
+  uint64_t inv;   /* n^-1 mod R */
+  uint64_t one;   /* R mod n, 1 in Montgomery form */
+  uint64_t r2;    /* R^2 mod n */
+} Mont;
+
+static uint32_t const trial_primes[] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+};
+
+static uint64_t const bases_32[] = { 2, 7, 61 };
+
+/* The batch filter divides by the odd primes up to 251; a survivor
+ * below 257^2 is prime. */
+#define FILTER_PRIMES 53
+#define FILTER_LIMIT (257 * 257)
+#define LANES 8
+
+/* The range test sieves by the primes below this before BPSW, a chunk
+ * of numbers at a time. */
+#define RANGE_SIEVE_LIMIT 65536
+#define RANGE_PRIMES 6542
+#define RANGE_CHUNK 32768
+
+/* Pollard rho multiplies this many differences before taking a gcd,
+ * and runs this many walks at once. */
+#define RHO_BATCH 128
+#define RHO_WALKS 2
+
+#define MAX_BASES 3
+#define WINDOW_BITS 4
+#define WINDOW_SIZE (1 << WINDOW_BITS)
+
+/* t R^-1 mod n for t < n R. With q = t n^-1 mod R the low words of t
+ * and q n agree, so the difference of the high words is the answer. */
+static inline uint64_t
+mont_redc (Mont const *m, u128 t)
+{
+  uint64_t q = (uint64_t)t * m->inv;
+  uint64_t h = (uint64_t)(((u128)q * m->n) >> 64);
+  uint64_t hi = (uint64_t)(t >> 64);
+
+  return hi >= h ? hi - h : hi - h + m->n;
+}
+
+static inline uint64_t
+mont_mul (Mont const *m, uint64_t a, uint64_t b)
+{
+  return mont_redc(m, (u128)a * b);
+}
+
+static inline uint64_t
+add_mod (uint64_t a, uint64_t b, uint64_t n)
+{
+  uint64_t t = a + b;
+
+  return t < a || t >= n ? t - n : t;
+}
+
+/* a - b mod n where the correction goes either way at random, so it is
+ * selected rather than branched on. Where it seldom happens, as in
+ * rho's x^2 + c, add_mod()'s branch is cheaper. */
+static inline uint64_t
+sub_mod_sel (uint64_t a, uint64_t b, uint64_t n)
+{
+  uint64_t t;
+  bool borrow = __builtin_sub_overflow(a, b, &t);
+
+  return t + (n & -(uint64_t)borrow);
+}
+
+/* a b R^-1 - c. The high word of a b is ready before the reduction's
+ * products are, so c comes off it while they run. */
+static inline uint64_t
+mont_mul_sub (Mont const *m, uint64_t a, uint64_t b, uint64_t c)
+{
+  u128 t = (u128)a * b;
+  uint64_t q = (uint64_t)t * m->inv;
+  uint64_t h = (uint64_t)(((u128)q * m->n) >> 64);
+  uint64_t hi = sub_mod_sel((uint64_t)(t >> 64), c, m->n);
+
+  return hi >= h ? hi - h : hi - h + m->n;
+}
+
+/* Montgomery form of any a < 2^64. */
+static inline uint64_t
+mont_to (Mont const *m, uint64_t a)
+{
+  return mont_mul(m, a, m->r2);
+}
+
+static void
+mont_init (Mont *m, uint64_t n)
+{
+  uint64_t inv = (3 * n) ^ 2;   /* right to 5 bits; Newton doubles that */
+  uint64_t two;
+
+  for (int i = 0; i < 4; i++)
+    inv *= 2 - n * inv;
+
+  m->n = n;
+  m->inv = inv;
+  m->one = -n % n;
+  two = m->one + m->one;
+  if (two >= n || two < m->one)
+    two -= n;
+
+  /* 2 R squared six times is 2^64 R = R^2. */
+  m->r2 = two;
+  for (int i = 0; i < 6; i++)
+    m->r2 = mont_mul(m, m->r2, m->r2);
+}
+
+/*
+ * Strong probable-prime test of n to several bases at once. The
+ * exponentiations are independent, so they run in lockstep and the
+ * multiplier latency of one hides behind the others.
+ */
+static inline __attribute__((always_inline)) bool
+strong_probable_prime (Mont const *m, uint64_t const *bases, int k)
+{
+  uint64_t d = m->n - 1, minus_one = m->n - m->one;
+  int s = __builtin_ctzll(d);
+  uint64_t a[MAX_BASES], x[MAX_BASES], pow[WINDOW_SIZE][MAX_BASES];
+
+  d >>= s;
+  for (int i = 0; i < k; i++)
+  {
+    a[i] = mont_to(m, bases[i]);
+    pow[0][i] = m->one;
+    pow[1][i] = a[i];
+  }
+  for (int j = 2; j < WINDOW_SIZE; j++)
+#pragma GCC unroll 3
+    for (int i = 0; i < k; i++)
+      pow[j][i] = mont_mul(m, pow[j - 1][i], a[i]);
+
+  /* Fixed windows, so the exponent's bits never steer a branch. */
+  int shift = (63 - __builtin_clzll(d)) / WINDOW_BITS * WINDOW_BITS;
+  for (int i = 0; i < k; i++)
+    x[i] = pow[d >> shift][i];
+  while ((shift -= WINDOW_BITS) >= 0)
+  {
+    unsigned w = (unsigned)(d >> shift) & (WINDOW_SIZE - 1);
+
+#pragma GCC unroll 4
+    for (int b = 0; b < WINDOW_BITS; b++)
+#pragma GCC unroll 3
+      for (int i = 0; i < k; i++)
+        x[i] = mont_mul(m, x[i], x[i]);
+#pragma GCC unroll 3
+    for (int i = 0; i < k; i++)
+      x[i] = mont_mul(m, x[i], pow[w][i]);
+  }
+
+  for (int i = 0; i < k; i++)
+  {
+    uint64_t y = x[i];
+
+    /* A base that is a multiple of n says nothing. */
+    if (a[i] == 0 || y == m->one || y == minus_one)
+      continue;
+    for (int r = 1; r < s && y != minus_one; r++)
+    {
+      y = mont_mul(m, y, y);
+      if (y == m->one)
+        return false;
+    }
+    if (y != minus_one)
+      return false;
+  }
+  return true;
+}
+
+/* The end of a base-2 strong probable-prime test, from x = 2^d for
+ * n - 1 = d 2^s. */
+static bool
+sprp2_end (Mont const *m, uint64_t x, int s)
+{
+  uint64_t minus_one = m->n - m->one;
+
+  if (x == m->one || x == minus_one)
+    return true;
+  for (int r = 1; r < s; r++)
+  {
+    x = mont_mul(m, x, x);
+    if (x == minus_one)
+      return true;
+    if (x == m->one)
+      return false;
+  }
+  return false;
+}
+
+/* (a / n) for odd n. */
+static int
+jacobi (uint64_t a, uint64_t n)
+{
+  int j = 1;
+
+  if (a >= n)
+    a %= n;
+  while (a != 0)
+  {
+    int z = __builtin_ctzll(a);
+
+    a >>= z;
+    if (z & 1 && (n % 8 == 3 || n % 8 == 5))
+      j = -j;
+    if (a % 4 == 3 && n % 4 == 3)
+      j = -j;
+
+    uint64_t t = a;
+    a = n % t;
+    n = t;
+  }
+  return n == 1 ? j : 0;
+}
+
+static bool
+is_square128 (u128 n)
+{
+  u128 r = (u128)sqrtl((long double)n);
+
+  if (r > UINT64_MAX)
+    r = UINT64_MAX;
+  while (r * r > n)
+    r--;
+  while (r < UINT64_MAX && (r + 1) * (r + 1) <= n)
+    r++;
+  return r * r == n;
+}
+
+/*
+ * Extra-strong Lucas test: the first P of 3, 4, 5, ... with (D / n) = -1
+ * for D = P^2 - 4, and Q = 1. With n + 1 = d 2^s, n passes if U_d = 0
+ * and V_d = +-2, or V_(d 2^r) = 0 for some r < s - 1.
+ *
+ * With Q = 1 there are no powers of Q to carry: V_k and V_(k+1) climb
+ * the bits of d as a ladder, two independent products a bit, and from
+ * (V_0, V_1) = (2, P) leading zero bits leave them as they are. U_d is
+ * never formed: D U_d = 2 V_(d+1) - P V_d, so with V_d = +-2 it is 0
+ * exactly when V_(d+1) = +-P.
+ */
+
+/* P for n past 2^32, or 0 if the search shows n composite. */
+static uint64_t
+lucas_p (uint64_t n)
+{
+  for (uint64_t P = 3; ; P++)
+  {
+    int j = jacobi(P * P - 4, n);
+
+    if (j == -1)
+      return P;
+    if (j == 0)
+      return 0;
+
+    /* No such D comes for a square. */
+    if (P == 20 && is_square128(n))
+      return 0;
+  }
+}
+
+/* k becomes 2k + bit. Squaring both V_k and V_(k+1) costs a product
+ * but takes the choice between them off the chain of dependent ones,
+ * and the bits go either way at random, so the choice is a mask. */
+static inline void
+lucas_step (Mont const *m, uint64_t v[2], uint64_t bit, uint64_t p, uint64_t two)
+{
+  uint64_t mask = -bit;
+  uint64_t v00 = mont_mul_sub(m, v[0], v[0], two);
+  uint64_t v01 = mont_mul_sub(m, v[0], v[1], p);
+  uint64_t v11 = mont_mul_sub(m, v[1], v[1], two);
+
+  v[0] = (v01 & mask) | (v00 & ~mask);
+  v[1] = (v11 & mask) | (v01 & ~mask);
+}
+
+/* k becomes 2k + bit in two products, the term to square picked
+ * first. The pick then sits on the chain, which a lone ladder feels;
+ * where other lanes fill the wait, the product saved is the gain. */
+static inline void
+lucas_step_sel (Mont const *m, uint64_t v[2], uint64_t bit, uint64_t p, uint64_t two)
+{
+  uint64_t mask = -bit, sq = v[0] ^ ((v[0] ^ v[1]) & mask);
+  uint64_t mid = mont_mul_sub(m, v[0], v[1], p);
+  uint64_t end = mont_mul_sub(m, sq, sq, two);
+
+  v[0] = (mid & mask) | (end & ~mask);
+  v[1] = (end & mask) | (mid & ~mask);
+}
+
+static bool
+lucas_end (Mont const *m, uint64_t const v[2], int s, uint64_t p, uint64_t two)
+{
+  uint64_t n = m->n, x = v[0];
+
+  if ((x == two && v[1] == p) || (x == n - two && v[1] == n - p) || x == 0)
+    return true;
+  for (int r = 1; r < s - 1; r++)
+  {
+    x = mont_mul_sub(m, x, x, two);
+    if (x == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * BPSW for odd n past 2^32: base 2 and Lucas in lockstep. Both climb
+ * about the same 64 bits, and each is one chain of dependent products,
+ * so run together they take little longer than either alone. 2^k is
+ * doubled rather than multiplied, as x - (n - x), under a mask like
+ * the Lucas swaps.
+ */
+static bool
+bpsw (Mont const *m)
+{
+  uint64_t n = m->n, d = n - 1, e = n + 1, P = lucas_p(n), p, two, x, v[2];
+  int s = __builtin_ctzll(d), t = __builtin_ctzll(e);
+
+  if (P == 0)
+    return false;
+  d >>= s;
+  e >>= t;
+  two = add_mod(m->one, m->one, n);
+  p = mont_to(m, P);
+  x = m->one;
+  v[0] = two;
+  v[1] = p;
+  for (int b = 63 - __builtin_clzll(d | e); b >= 0; b--)
+  {
+    x = mont_mul(m, x, x);
+    x = sub_mod_sel(x, (n - x) & -(d >> b & 1), n);
+    lucas_step(m, v, e >> b & 1, p, two);
+  }
+  return sprp2_end(m, x, s) && lucas_end(m, v, t, p, two);
+}
+
+/* Exact for odd n with no factor below 59: Miller-Rabin below 2^32,
+ * and BPSW above, which has no pseudoprimes below 2^64. */
+static bool
+prime_test (Mont const *m)
+{
+  if (m->n >> 32 == 0)
+    return strong_probable_prime(m, bases_32, 3);
+  return bpsw(m);
+}
+
+bool
+primes_is_prime (uint64_t n)
+{
+  Mont m;
+
+  if (n < 2)
+    return false;
+  /* Unrolled, each divisor is a constant and the division a multiply. */
+#pragma GCC unroll 16
+  for (size_t i = 0; i < sizeof(trial_primes) / sizeof(trial_primes[0]); i++)
+    if (n % trial_primes[i] == 0)
+      return n == trial_primes[i];
+  if (n < 59 * 59)
+    return true;
+
+  mont_init(&m, n);
+  return prime_test(&m);
+}
+
+/*
+ * Batch filter. n is divisible by an odd p exactly when n p^-1 mod 2^64
+ * is at most (2^64 - 1) / p, which is a multiply and a compare per lane
+ * rather than a division.
+ */
+typedef uint64_t (*FilterFn)(uint64_t const *n, size_t count);
+
+static uint32_t filter_primes[FILTER_PRIMES];
+static uint64_t filter_inv[FILTER_PRIMES];
+static uint64_t filter_lim[FILTER_PRIMES];
+static u128 filter_inv128[FILTER_PRIMES];
+static u128 filter_lim128[FILTER_PRIMES];
+static FilterFn filter;
+static once_flag filter_once = ONCE_FLAG_INIT;
+
+/* Bit i set: n[i] has an odd prime factor up to 251 other than itself. */
+static uint64_t
+filter_scalar (uint64_t const *n, size_t count)
+{
+  uint64_t out = 0;
+
+  for (size_t i = 0; i < count; i++)
+    for (int k = 0; k < FILTER_PRIMES; k++)
+      if (n[i] * filter_inv[k] <= filter_lim[k] && n[i] != filter_primes[k]) {
+        out |= (uint64_t)1 << i;
+        break;
+      }
+  return out;
+}
+
+#if defined(__x86_64__)
+/* AVX2 has no 64-bit low multiply; build it from three 32 x 32 ones.
+ * Unsigned compares go through the signed one with the sign bit flipped. */
+__attribute__((target("avx2")))
+static uint64_t
+filter_avx2 (uint64_t const *n, size_t count)
+{
+  __m256i const sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+  uint64_t out = 0;
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)&n[i]);
+    __m256i v_hi = _mm256_srli_epi64(v, 32);
+    __m256i hit = _mm256_setzero_si256();
+
+    for (int k = 0; k < FILTER_PRIMES; k++)
+    {
+      __m256i inv = _mm256_set1_epi64x((long long)filter_inv[k]);
+      __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(v_hi, inv),
+                                       _mm256_mul_epu32(v, _mm256_srli_epi64(inv, 32)));
+      __m256i t = _mm256_add_epi64(_mm256_mul_epu32(v, inv), _mm256_slli_epi64(cross, 32));
+      __m256i over = _mm256_cmpgt_epi64(_mm256_xor_si256(t, sign),
+                                        _mm256_set1_epi64x((long long)(filter_lim[k] ^ (1ULL << 63))));
+      __m256i self = _mm256_cmpeq_epi64(v, _mm256_set1_epi64x(filter_primes[k]));
+
+      hit = _mm256_or_si256(hit, _mm256_andnot_si256(_mm256_or_si256(over, self),
+                                                     _mm256_set1_epi64x(-1)));
+    }
+    out |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(hit)) << i;
+  }
+  if (i < count)
+    out |= filter_scalar(n + i, count - i) << i;
+  return out;
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static uint64_t
+filter_avx512 (uint64_t const *n, size_t count)
+{
+  uint64_t out = 0;
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m512i v = _mm512_loadu_si512((void const *)&n[i]);
+    __mmask8 hit = 0;
+
+    for (int k = 0; k < FILTER_PRIMES; k++)
+    {
+      __m512i t = _mm512_mullo_epi64(v, _mm512_set1_epi64((long long)filter_inv[k]));
+      __mmask8 div = _mm512_cmple_epu64_mask(t, _mm512_set1_epi64((long long)filter_lim[k]));
+
+      hit |= _mm512_mask_cmpneq_epu64_mask(div, v, _mm512_set1_epi64(filter_primes[k]));
+    }
+    out |= (uint64_t)hit << i;
+  }
+  if (i < count)
+    out |= filter_scalar(n + i, count - i) << i;
+  return out;
+}
+#endif /* defined(__x86_64__) */
+
+static void
+filter_init (void)
+{
+  int k = 0;
+
+  for (uint32_t p = 3; k < FILTER_PRIMES; p += 2)
+  {
+    bool prime = true;
+    for (uint32_t q = 3; q * q <= p && prime; q += 2)
+      prime = p % q != 0;
+    if (!prime)
+      continue;
+
+    uint64_t inv = p;
+    for (int i = 0; i < 5; i++)
+      inv *= 2 - p * inv;
+    filter_primes[k] = p;
+    filter_inv[k] = inv;
+    filter_lim[k] = UINT64_MAX / p;
+
+    u128 inv128 = inv;
+    inv128 *= 2 - p * inv128;
+    filter_inv128[k] = inv128;
+    filter_lim128[k] = ~(u128)0 / p;
+    k++;
+  }
+
+  filter = filter_scalar;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    filter = filter_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    filter = filter_avx2;
+#endif
+}
+
+/*
+ * Base-2 strong probable-prime test of up to LANES unrelated odd moduli
+ * at once, interleaved like the bases in strong_probable_prime(). As in
+ * bpsw(), 2^k is squared and then doubled under a mask, which costs one
+ * product a bit against a window's 1.25. Spare lanes repeat lane 0.
+ */
+static void
+base2_lanes (Mont const *m, size_t k, bool pass[LANES])
+{
+  uint64_t x[LANES], d[LANES];
+  int s[LANES], top = 0;
+
+  for (size_t i = 0; i < LANES; i++)
+  {
+    Mont const *mi = &m[i < k ? i : 0];
+
+    d[i] = mi->n - 1;
+    s[i] = __builtin_ctzll(d[i]);
+    d[i] >>= s[i];
+    if (63 - __builtin_clzll(d[i]) > top)
+      top = 63 - __builtin_clzll(d[i]);
+    x[i] = mi->one;
+  }
+
+  for (int b = top; b >= 0; b--)
+#pragma GCC unroll 8
+    for (size_t i = 0; i < LANES; i++)
+    {
+      Mont const *mi = &m[i < k ? i : 0];
+
+      x[i] = mont_mul(mi, x[i], x[i]);
+      x[i] = sub_mod_sel(x[i], (mi->n - x[i]) & -(d[i] >> b & 1), mi->n);
+    }
+
+  for (size_t i = 0; i < k; i++)
+  {
+    uint64_t y = x[i], minus_one = m[i].n - m[i].one;
+
+    pass[i] = y == m[i].one || y == minus_one;
+    for (int r = 1; r < s[i] && !pass[i]; r++)
+    {
+      y = mont_mul(&m[i], y, y);
+      if (y == m[i].one)
+        break;
+      pass[i] = y == minus_one;
+    }
+  }
+}
+
+/* The Lucas half of BPSW for up to LANES numbers at once, their
+ * ladders climbing the bits in step. Leading zero bits leave (2, P)
+ * as it is, so the shorter ladders simply start later. */
+static void
+lucas_lanes (Mont const *const *m, size_t k, bool pass[LANES])
+{
+  uint64_t d[LANES], p[LANES], two[LANES], v[LANES][2], P[LANES];
+  int s[LANES], top = 0;
+
+  for (size_t i = 0; i < k; i++)
+  {
+    P[i] = lucas_p(m[i]->n);
+    pass[i] = P[i] != 0;
+  }
+  for (size_t i = 0; i < LANES; i++)
+  {
+    Mont const *mi = m[i < k ? i : 0];
+
+    d[i] = mi->n + 1;
+    s[i] = __builtin_ctzll(d[i]);
+    d[i] >>= s[i];
+    if (63 - __builtin_clzll(d[i]) > top)
+      top = 63 - __builtin_clzll(d[i]);
+    two[i] = add_mod(mi->one, mi->one, mi->n);
+    p[i] = mont_to(mi, i < k && pass[i] ? P[i] : 3);
+    v[i][0] = two[i];
+    v[i][1] = p[i];
+  }
+
+  for (int b = top; b >= 0; b--)
+#pragma GCC unroll 8
+    for (size_t i = 0; i < LANES; i++)
+      lucas_step_sel(m[i < k ? i : 0], v[i], d[i] >> b & 1, p[i], two[i]);
+
+  for (size_t i = 0; i < k; i++)
+    pass[i] = pass[i] && lucas_end(m[i], v[i], s[i], p[i], two[i]);
+}
+
+/* Whatever base 2 let through gets the rest of its base set, or the
+ * Lucas half of BPSW past 2^32. */
+static void
+test_lanes (uint64_t const *n, size_t const *idx, size_t k, uint64_t *mask)
+{
+  Mont m[LANES];
+  Mont const *big[LANES];
+  size_t big_idx[LANES], n_big = 0;
+  bool pass[LANES];
+
+  for (size_t i = 0; i < k; i++)
+    mont_init(&m[i], n[idx[i]]);
+  base2_lanes(m, k, pass);
+
+  for (size_t i = 0; i < k; i++)
+  {
+    if (!pass[i])
+      continue;
+    if (m[i].n >> 32 != 0) {
+      big[n_big] = &m[i];
+      big_idx[n_big++] = idx[i];
+    } else if (strong_probable_prime(&m[i], bases_32 + 1, 2)) {
+      mask[idx[i] / 64] |= (uint64_t)1 << (idx[i] % 64);
+    }
+  }
+  if (n_big == 0)
+    return;
+
+  lucas_lanes(big, n_big, pass);
+  for (size_t i = 0; i < n_big; i++)
+    if (pass[i])
+      mask[big_idx[i] / 64] |= (uint64_t)1 << (big_idx[i] % 64);
+}
+
+void
+primes_is_prime_batch (uint64_t const *n, size_t count, uint64_t *mask)
+{
+  size_t idx[LANES], k = 0;
+
+  call_once(&filter_once, filter_init);
+
+  for (size_t at = 0; at < count; at += 64)
+  {
+    size_t len = count - at < 64 ? count - at : 64;
+    uint64_t composite = filter(n + at, len);
+
+    mask[at / 64] = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+      uint64_t v = n[at + i];
+
+      if (v < 2 || composite >> i & 1 || (v % 2 == 0 && v != 2))
+        continue;
+      if (v < FILTER_LIMIT) {
+        mask[at / 64] |= (uint64_t)1 << i;
+        continue;
+      }
+      idx[k++] = at + i;
+      if (k == LANES) {
+        test_lanes(n, idx, k, mask);
+        k = 0;
+      }
+    }
+  }
+  if (k > 0)
+    test_lanes(n, idx, k, mask);
+}
+
+/*
+ * Factoring. The filter's primes go by exact division, which is a
+ * multiply by p^-1 mod 2^64 like the batch filter's test. What is left
+ * has no factor below 257, so under 257^2 it is prime, and otherwise it
+ * is prime or splits by Pollard rho.
+ */
+static uint64_t
+gcd (uint64_t a, uint64_t b)
+{
+  int shift;
+
+  if (a == 0)
+    return b;
+  if (b == 0)
+    return a;
+  shift = __builtin_ctzll(a | b);
+  a >>= __builtin_ctzll(a);
+  do
+  {
+    b >>= __builtin_ctzll(b);
+    if (a > b) {
+      uint64_t t = a;
+      a = b;
+      b = t;
+    }
+    b -= a;
+  } while (b != 0);
+  return a << shift;
+}
+
+/* x^2 + c, in Montgomery form: the map is still a random-looking
+ * polynomial mod every factor of n, which is all rho needs. */
+static inline uint64_t
+rho_step (Mont const *m, uint64_t x, uint64_t c)
+{
+  return add_mod(mont_mul(m, x, x), c, m->n);
+}
+
+/*
+ * Brent's variant of Pollard rho on odd composite n: y runs ahead of x
+ * in doubling strides, and the differences are multiplied together
+ * RHO_BATCH at a time so that the gcd is rare. RHO_WALKS walks, with
+ * c, c + 1, ..., run in step: each is one chain of dependent products,
+ * so the others fill its latency, and the first to split n ends all.
+ * A batch whose product hits n is replayed one step at a time from its
+ * start. Returns a factor, or n if all these c failed.
+ */
+static uint64_t
+rho_brent (Mont const *m, uint64_t c)
+{
+  uint64_t n = m->n, x[RHO_WALKS], y[RHO_WALKS], ys[RHO_WALKS], q[RHO_WALKS];
+  uint64_t g[RHO_WALKS];
+  bool done = false;
+
+  for (int j = 0; j < RHO_WALKS; j++)
+  {
+    y[j] = add_mod(m->one, m->one, n);
+    q[j] = m->one;
+    g[j] = 1;
+  }
+
+  for (uint64_t r = 1; !done; r *= 2)
+  {
+    for (int j = 0; j < RHO_WALKS; j++)
+      x[j] = y[j];
+    for (uint64_t i = 0; i < r; i++)
+#pragma GCC unroll 4
+      for (int j = 0; j < RHO_WALKS; j++)
+        y[j] = rho_step(m, y[j], c + (uint64_t)j);
+    for (uint64_t k = 0; k < r && !done; k += RHO_BATCH)
+    {
+      uint64_t steps = r - k < RHO_BATCH ? r - k : RHO_BATCH;
+
+      for (int j = 0; j < RHO_WALKS; j++)
+        ys[j] = y[j];
+      for (uint64_t i = 0; i < steps; i++)
+#pragma GCC unroll 4
+        for (int j = 0; j < RHO_WALKS; j++)
+        {
+          y[j] = rho_step(m, y[j], c + (uint64_t)j);
+          q[j] = mont_mul(m, q[j], sub_mod_sel(x[j], y[j], n));
+        }
+      /* One gcd for all the walks; only a hit looks at each. */
+      uint64_t all = q[0];
+      for (int j = 1; j < RHO_WALKS; j++)
+        all = mont_mul(m, all, q[j]);
+      if (gcd(all, n) != 1) {
+        for (int j = 0; j < RHO_WALKS; j++)
+          g[j] = gcd(q[j], n);
+        done = true;
+      }
+    }
+  }
+
+  for (int j = 0; j < RHO_WALKS; j++)
+    if (g[j] != 1 && g[j] != n)
+      return g[j];
+  for (int j = 0; j < RHO_WALKS; j++)
+  {
+    if (g[j] != n)
+      continue;
+    do
+    {
+      ys[j] = rho_step(m, ys[j], c + (uint64_t)j);
+      g[j] = gcd(sub_mod_sel(x[j], ys[j], n), n);
+    } while (g[j] == 1);
+    if (g[j] != n)
+      return g[j];
+  }
+  return n;
+}
+
+/* Adds the prime factors of odd n, which has none below 257. */
+static int
+factor_large (uint64_t n, uint64_t *f, int k)
+{
+  Mont m;
+  uint64_t d;
+
+  if (n < FILTER_LIMIT) {
+    f[k++] = n;
+    return k;
+  }
+  mont_init(&m, n);
+  if (prime_test(&m)) {
+    f[k++] = n;
+    return k;
+  }
+  for (uint64_t c = 1; (d = rho_brent(&m, c)) == n; c += RHO_WALKS)
+    ;
+  k = factor_large(d, f, k);
+  return factor_large(n / d, f, k);
+}
+
+int
+primes_factor (uint64_t n, uint64_t f[PRIMES_MAX_FACTORS])
+{
+  int k = 0;
+
+  if (n < 2)
+    return 0;
+  call_once(&filter_once, filter_init);
+
+  for (int z = __builtin_ctzll(n); k < z; k++)
+    f[k] = 2;
+  n >>= k;
+  for (int i = 0; i < FILTER_PRIMES && n >= (uint64_t)filter_primes[i] * filter_primes[i]; i++)
+    while (n * filter_inv[i] <= filter_lim[i])
+    {
+      n *= filter_inv[i];
+      f[k++] = filter_primes[i];
+    }
+  if (n == 1)
+    return k;
+
+  /* Rho finds factors in no order; the small ones came sorted. */
+  int from = k;
+  k = factor_large(n, f, k);
+  for (int i = from + 1; i < k; i++)
+  {
+    uint64_t v = f[i];
+    int j = i;
+    for (; j > from && f[j - 1] > v; j--)
+      f[j] = f[j - 1];
+    f[j] = v;
+  }
+  return k;
+}
+
+/*
+ * 128 bits. Montgomery arithmetic as above with R = 2^128: a product is
+ * four 64 x 64 multiplies into 256 bits, and reduction needs only the
+ * high half of another. The test is BPSW again, a base-2 strong
+ * probable-prime test and an extra-strong Lucas test; past 2^64 it is
+ * not proven exact, but no known composite passes.
+ */
+typedef struct Mont128_s {
+  u128 n;
+  u128 inv;       /* n^-1 mod R */
+  u128 one;       /* R mod n */
+  u128 r2;        /* R^2 mod n */
+} Mont128;
+
+static uint32_t range_primes[RANGE_PRIMES];
+static once_flag range_once = ONCE_FLAG_INIT;
+
+/* The carries come straight from the flags, and the corrections are
+ * selected rather than branched on: they go either way at random. */
+static inline u128
+add_mod128 (u128 a, u128 b, u128 n)
+{
+  u128 t, u;
+  bool carry = __builtin_add_overflow(a, b, &t);
+  bool borrow = __builtin_sub_overflow(t, n, &u);
+
+  return u + (n & -(u128)(borrow & !carry));
+}
+
+static inline u128
+sub_mod128 (u128 a, u128 b, u128 n)
+{
+  u128 t;
+  bool borrow = __builtin_sub_overflow(a, b, &t);
+
+  return t + (n & -(u128)borrow);
+}
+
+/* a b = hi R + lo. */
+static inline u128
+mul_wide (u128 a, u128 b, u128 *lo)
+{
+  uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64);
+  uint64_t b0 = (uint64_t)b, b1 = (uint64_t)(b >> 64);
+  u128 p00 = (u128)a0 * b0, p01 = (u128)a0 * b1;
+  u128 p10 = (u128)a1 * b0, p11 = (u128)a1 * b1;
+  u128 mid = (p00 >> 64) + (uint64_t)p01 + (uint64_t)p10;
+
+  *lo = (uint64_t)p00 | mid << 64;
+  return p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+}
+
+/* a^2 = hi R + lo: the cross term is one product, doubled. */
+static inline u128
+sqr_wide (u128 a, u128 *lo)
+{
+  uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64);
+  u128 p00 = (u128)a0 * a0, p01 = (u128)a0 * a1, p11 = (u128)a1 * a1;
+  u128 mid = (p00 >> 64) + ((u128)(uint64_t)p01 << 1);
+
+  *lo = (uint64_t)p00 | mid << 64;
+  return p11 + ((p01 >> 64) << 1) + (mid >> 64);
+}
+
+/* (hi R + lo) R^-1 - c for hi < n. The high half is ready before the
+ * reduction's products are, so c comes off it while they run. */
+static inline u128
+mont128_redc_sub (Mont128 const *m, u128 hi, u128 lo, u128 c)
+{
+  u128 unused, h = mul_wide(lo * m->inv, m->n, &unused);
+
+  return sub_mod128(sub_mod128(hi, c, m->n), h, m->n);
+}
+
+static inline u128
+mont128_mul (Mont128 const *m, u128 a, u128 b)
+{
+  u128 lo, hi = mul_wide(a, b, &lo);
+
+  return mont128_redc_sub(m, hi, lo, 0);
+}
+
+static inline u128
+mont128_sqr (Mont128 const *m, u128 a)
+{
+  u128 lo, hi = sqr_wide(a, &lo);
+
+  return mont128_redc_sub(m, hi, lo, 0);
+}
+
+static inline u128
+mont128_sqr_sub (Mont128 const *m, u128 a, u128 c)
+{
+  u128 lo, hi = sqr_wide(a, &lo);
+
+  return mont128_redc_sub(m, hi, lo, c);
+}
+
+static inline int
+bits128 (u128 x)
+{
+  return x >> 64 ? 128 - __builtin_clzll((uint64_t)(x >> 64))
+                 : 64 - __builtin_clzll((uint64_t)x | 1);
+}
+
+static inline int
+ctz128 (u128 x)
+{
+  return (uint64_t)x ? __builtin_ctzll((uint64_t)x) : 64 + __builtin_ctzll((uint64_t)(x >> 64));
+}
+
+/* For n of more than 64 bits: R mod n comes from doubling the highest
+ * power of 2 below n, so nothing divides. */
+static void
+mont128_init (Mont128 *m, u128 n)
+{
+  u128 inv = (3 * n) ^ 2;
+
+  for (int i = 0; i < 5; i++)
+    inv *= 2 - n * inv;
+
+  m->n = n;
+  m->inv = inv;
+  m->one = (u128)1 << (bits128(n) - 1);
+  for (int i = bits128(n) - 1; i < 128; i++)
+    m->one = add_mod128(m->one, m->one, n);
+
+  /* 2 R squared seven times is 2^128 R = R^2. */
+  m->r2 = add_mod128(m->one, m->one, n);
+  for (int i = 0; i < 7; i++)
+    m->r2 = mont128_sqr(m, m->r2);
+}
+
+/* c x mod n for a small signed c, by doubling and adding. */
+static inline u128
+mul_small128 (u128 x, int64_t c, u128 n)
+{
+  uint64_t k = c < 0 ? -(uint64_t)c : (uint64_t)c;
+  u128 r = 0;
+
+  for (int b = 63 - __builtin_clzll(k | 1); b >= 0; b--)
+  {
+    r = add_mod128(r, r, n);
+    if (k >> b & 1)
+      r = add_mod128(r, x, n);
+  }
+  return c < 0 ? sub_mod128(0, r, n) : r;
+}
+
+/* n mod p for p below 2^32, in 64-bit divisions. */
+static uint32_t
+mod_small (u128 n, uint32_t p)
+{
+  uint64_t r = (uint64_t)(n >> 64) % p;
+
+  r = (r << 32 | (uint64_t)n >> 32) % p;
+  return (uint32_t)((r << 32 | (uint32_t)n) % p);
+}
+
+/* Strong probable prime to base 2; doubling in place of a multiply by
+ * the base. */
+static bool
+sprp2_128 (Mont128 const *m)
+{
+  u128 d = m->n - 1, minus_one = m->n - m->one, x;
+  int s = ctz128(d);
+
+  d >>= s;
+  x = add_mod128(m->one, m->one, m->n);
+  for (int b = bits128(d) - 2; b >= 0; b--)
+  {
+    x = mont128_sqr(m, x);
+    if (d >> b & 1)
+      x = add_mod128(x, x, m->n);
+  }
+
+  if (x == m->one || x == minus_one)
+    return true;
+  for (int r = 1; r < s; r++)
+  {
+    x = mont128_sqr(m, x);
+    if (x == minus_one)
+      return true;
+    if (x == m->one)
+      return false;
+  }
+  return false;
+}
+
+/* (a / n) for odd n past 2^64 and a below 2^32, by reciprocity. */
+static int
+jacobi128 (uint64_t a, u128 n)
+{
+  int z = __builtin_ctzll(a), j = 1;
+
+  a >>= z;
+  if (z & 1 && (n % 8 == 3 || n % 8 == 5))
+    j = -j;
+  if (a % 4 == 3 && n % 4 == 3)
+    j = -j;
+  return j * jacobi(mod_small(n, (uint32_t)a), a);
+}
+
+/*
+ * The extra-strong Lucas test of lucas() at 128 bits. Only V_k and
+ * V_(k+1) climb the ladder, and with Q = 1 there are no powers of Q to
+ * carry along, so a bit costs two products. Products are dear enough
+ * here that the square is chosen before it is taken, not after as in
+ * lucas(); the choices are masks either way.
+ */
+static bool
+lucas128 (Mont128 const *m)
+{
+  u128 n = m->n, d = n + 1, p, two, v0, v1;
+  uint64_t P = 3;
+  int s;
+
+  for (;; P++)
+  {
+    int j = jacobi128(P * P - 4, n);
+
+    if (j == 0)
+      return false;
+    if (j == -1)
+      break;
+
+    /* No such D comes for a square. */
+    if (P == 20 && is_square128(n))
+      return false;
+  }
+
+  s = ctz128(d);
+  d >>= s;
+
+  two = add_mod128(m->one, m->one, n);
+  p = mul_small128(m->one, (int64_t)P, n);
+  v0 = two;
+  v1 = p;
+  for (int b = bits128(d) - 1; b >= 0; b--)
+  {
+    u128 mask = -(u128)(d >> b & 1), sq = v0 ^ ((v0 ^ v1) & mask);
+    u128 lo, hi = mul_wide(v0, v1, &lo);
+    u128 mid = mont128_redc_sub(m, hi, lo, p);
+    u128 end = mont128_sqr_sub(m, sq, two);
+
+    /* k becomes 2k + bit. */
+    v0 = (mid & mask) | (end & ~mask);
+    v1 = (end & mask) | (mid & ~mask);
+  }
+
+  if ((v0 == two && v1 == p) || (v0 == n - two && v1 == n - p) || v0 == 0)
+    return true;
+  for (int r = 1; r < s - 1; r++)
+  {
+    v0 = mont128_sqr_sub(m, v0, two);
+    if (v0 == 0)
+      return true;
+  }
+  return false;
+}
+
+/* BPSW for odd n past 2^64 with no small factors. */
+static bool
+bpsw128 (u128 n)
+{
+  Mont128 m;
+
+  mont128_init(&m, n);
+  return sprp2_128(&m) && lucas128(&m);
+}
+
+bool
+primes_is_prime128 (primes_u128 n)
+{
+  if (n >> 64 == 0)
+    return primes_is_prime((uint64_t)n);
+  if (n % 2 == 0)
+    return false;
+
+  call_once(&filter_once, filter_init);
+  for (int k = 0; k < FILTER_PRIMES; k++)
+    if (n * filter_inv128[k] <= filter_lim128[k])
+      return false;
+  return bpsw128(n);
+}
+
+static void
+range_init (void)
+{
+  static uint8_t composite[RANGE_SIEVE_LIMIT];
+  int k = 0;
+
+  for (uint32_t p = 2; p < RANGE_SIEVE_LIMIT; p++)
+  {
+    if (composite[p])
+      continue;
+    range_primes[k++] = p;
+    for (uint32_t j = p * p; j < RANGE_SIEVE_LIMIT; j += p)
+      composite[j] = 1;
+  }
+}
+
+void
+primes_is_prime128_range (primes_u128 lo, size_t count, uint64_t *mask)
+{
+  size_t i = 0;
+
+  call_once(&range_once, range_init);
+  for (size_t w = 0; w < (count + 63) / 64; w++)
+    mask[w] = 0;
+
+  /* Below 2^64, the sieving primes could be in the range themselves. */
+  for (; i < count && (lo + i) >> 64 == 0; i++)
+    if (primes_is_prime((uint64_t)(lo + i)))
+      mask[i / 64] |= (uint64_t)1 << (i % 64);
+
+  for (; i < count; i += RANGE_CHUNK)
+  {
+    uint64_t composite[RANGE_CHUNK / 64] = { 0 };
+    size_t len = count - i < RANGE_CHUNK ? count - i : RANGE_CHUNK;
+    u128 base = lo + i;
+
+    for (int k = 0; k < RANGE_PRIMES; k++)
+    {
+      uint32_t p = range_primes[k], r = mod_small(base, p);
+
+      for (size_t j = r ? p - r : 0; j < len; j += p)
+        composite[j / 64] |= (uint64_t)1 << (j % 64);
+    }
+
+    for (size_t w = 0; w < (len + 63) / 64; w++)
+    {
+      uint64_t left = ~composite[w];
+
+      if (len - 64 * w < 64)
+        left &= ((uint64_t)1 << (len - 64 * w)) - 1;
+      for (; left; left &= left - 1)
+      {
+        size_t j = 64 * w + (size_t)__builtin_ctzll(left);
+        if (bpsw128(base + j))
+          mask[(i + j) / 64] |= (uint64_t)1 << ((i + j) % 64);
+      }
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef __primes_h__
+#define __primes_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Primality and factors of 64-bit integers, and primality to 128 bits.
+ *
+ * primes_is_prime() is exact for every n: trial division by the primes
+ * up to 53, then Miller-Rabin to bases {2, 7, 61} under 2^32 and BPSW
+ * above, a base-2 strong probable-prime test and an extra-strong Lucas
+ * test, which together have no pseudoprimes below 2^64. The two run in
+ * lockstep in Montgomery arithmetic. That suits primes, which need both
+ * halves anyway; a composite that fails base 2 still pays for the Lucas
+ * half, near twice what a test stopping after base 2 would cost it.
+ */
+
+bool primes_is_prime(uint64_t n);
+
+/* The same answers for count numbers at once, tuned for throughput:
+ * trial division runs across SIMD lanes, then the survivors' base-2
+ * tests run interleaved, and past 2^32 so do the Lucas tests of what
+ * passes. Bit i % 64 of mask[i / 64] is set if n[i] is prime; mask
+ * holds (count + 63) / 64 words. */
+void primes_is_prime_batch(uint64_t const *n, size_t count, uint64_t *mask);
+
+/*
+ * 128 bits: the same answers for n up to 2^128, by BPSW, a base-2
+ * strong probable-prime test and an extra-strong Lucas test, in
+ * Montgomery arithmetic on two 64-bit limbs. Below 2^64, where BPSW is
+ * known to be exact, it defers to primes_is_prime().
+ *
+ * A prime costs several microseconds, not the low microseconds one
+ * might hope for: the Lucas ladder is 128 steps of dependent two-limb
+ * products, and base 2 is another 128. Composites mostly stop at the
+ * trial division or base 2 and are far cheaper.
+ */
+__extension__ typedef unsigned __int128 primes_u128;
+
+bool primes_is_prime128(primes_u128 n);
+
+/* Whether each of lo, lo + 1, ..., lo + count - 1 is prime, into mask
+ * as primes_is_prime_batch() does; lo + count is at most 2^128. Primes
+ * below 2^16 are sieved out first, so BPSW sees about one number in
+ * twenty. */
+void primes_is_prime128_range(primes_u128 lo, size_t count, uint64_t *mask);
+
+/* 2^64 has no more prime factors than this. */
+#define PRIMES_MAX_FACTORS 64
+
+/*
+ * The prime factors of n, ascending and repeated by multiplicity, into
+ * f; returns how many. 0 and 1 have none.
+ *
+ * Trial division by the primes up to 251 takes out small factors. Each
+ * cofactor that fails primes_is_prime()'s test is split by Brent's
+ * variant of Pollard rho, in Montgomery form with two walks in step and
+ * one gcd per batch of steps.
+ *
+ * Rho takes about the square root of the factor it finds in steps, so
+ * this is nowhere near millions of calls a second on hard inputs: as
+ * measured here, random 64-bit n average about 20 us, and semiprimes
+ * with two 32-bit factors about 550 us. Primes, and numbers with no
+ * prime factor past 251, take under a microsecond.
+ */
+int primes_factor(uint64_t n, uint64_t f[PRIMES_MAX_FACTORS]);
+
+#endif /* !defined(__primes_h__) */
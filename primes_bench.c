@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "primes.h"
+
+#define MAX_REPS 1000
+
+__extension__ typedef unsigned __int128 u128;
+#define BENCH_SEED 0x7072696d6573
+
+/* A workload is an array of inputs drawn from one distribution. */
+typedef struct Workload_s {
+  char const *name;
+  void (*gen)(uint64_t *v, size_t n, uint64_t *rng);
+} Workload;
+
+static bool first_result = true;
+static volatile uint64_t sink;
+
+static uint64_t
+next (uint64_t *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1d;
+}
+
+static void
+gen_random (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; i++)
+    v[i] = next(rng);
+}
+
+static void
+gen_odd (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; i++)
+    v[i] = next(rng) | 1;
+}
+
+static void
+gen_primes (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; )
+  {
+    uint64_t x = next(rng) | 1;
+    if (primes_is_prime(x))
+      v[i++] = x;
+  }
+}
+
+static void
+gen_small (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; i++)
+    v[i] = next(rng) >> 32 | 1;
+}
+
+static uint64_t
+random_prime (int bits, uint64_t *rng)
+{
+  for (;;)
+  {
+    uint64_t x = next(rng) >> (64 - bits) | (uint64_t)1 << (bits - 1) | 1;
+    if (primes_is_prime(x))
+      return x;
+  }
+}
+
+/* p q with p of 16 to 32 bits and q filling the rest: rho's hard case. */
+static void
+gen_semiprime (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    int bits = 16 + (int)(next(rng) % 17);
+    v[i] = random_prime(bits, rng) * random_prime(64 - bits, rng);
+  }
+}
+
+/* Products of primes below 2^16, as many as fit. */
+static void
+gen_smooth (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    uint64_t x = 1, p;
+    while (p = random_prime(2 + (int)(next(rng) % 15), rng), x <= UINT64_MAX / p)
+      x *= p;
+    v[i] = x;
+  }
+}
+
+/* Pairs of words that make primes of 65 to 128 bits, high word first,
+ * for the 128-bit benches. */
+static void
+gen_primes128 (uint64_t *v, size_t n, uint64_t *rng)
+{
+  for (size_t i = 0; i + 1 < n; )
+  {
+    uint64_t hi = next(rng) >> (next(rng) % 64) | 1, lo = next(rng) | 1;
+    if (primes_is_prime128((u128)hi << 64 | lo)) {
+      v[i++] = hi;
+      v[i++] = lo;
+    }
+  }
+  if (n % 2)
+    v[n - 1] = 1;
+}
+
+static Workload const workloads[] = {
+  { "random", gen_random },
+  { "odd", gen_odd },
+  { "primes", gen_primes },
+  { "small", gen_small },
+  { "semiprime", gen_semiprime },
+  { "smooth", gen_smooth },
+  { "primes128", gen_primes128 },
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct Bench_s {
+  char const *name;
+  int (*run)(char const *workload, uint64_t const *v, size_t n, uint64_t *mask, int reps);
+} Bench;
+
+static int bench_is_prime(char const *workload, uint64_t const *v, size_t n,
+                          uint64_t *mask, int reps);
+static int bench_factor(char const *workload, uint64_t const *v, size_t n,
+                        uint64_t *mask, int reps);
+static int bench_is_prime128(char const *workload, uint64_t const *v, size_t n,
+                             uint64_t *mask, int reps);
+static int bench_range128(char const *workload, uint64_t const *v, size_t n,
+                          uint64_t *mask, int reps);
+
+static Bench const benches[] = {
+  { "is_prime", bench_is_prime },
+  { "factor", bench_factor },
+  { "is_prime128", bench_is_prime128 },
+  { "range128", bench_range128 },
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* One JSON object per measurement: nanoseconds per input, on one
+ * thread. */
+static void
+report (char const *bench, char const *workload, size_t n, double *ns, int reps,
+        uint64_t hits)
+{
+  for (int r = 0; r < reps; r++)
+    ns[r] /= (double)n;
+
+  BenchStats s = bench_stats(ns, reps);
+  printf("%s\n    {\"bench\": \"%s\", \"workload\": \"%s\", \"n\": %zu, "
+         "\"reps\": %d, \"hits\": %" PRIu64 ", ", first_result ? "" : ",", bench,
+         workload, n, reps, hits);
+  first_result = false;
+  bench_print_stats("ns_per_input", &s, 2);
+  printf(", \"minputs_per_s\": %.2f}", s.median > 0 ? 1e3 / s.median : 0.0);
+  fflush(stdout);
+}
+
+static int
+bench_is_prime (char const *workload, uint64_t const *v, size_t n, uint64_t *mask, int reps)
+{
+  double single[MAX_REPS], batch[MAX_REPS];
+  uint64_t hits = 0, batch_hits = 0;
+
+  for (int r = 0; r < reps; r++)
+  {
+    double t = bench_now_ns();
+    hits = 0;
+    for (size_t i = 0; i < n; i++)
+      hits += primes_is_prime(v[i]);
+    single[r] = bench_now_ns() - t;
+
+    t = bench_now_ns();
+    primes_is_prime_batch(v, n, mask);
+    batch[r] = bench_now_ns() - t;
+
+    batch_hits = 0;
+    for (size_t w = 0; w < (n + 63) / 64; w++)
+      batch_hits += (uint64_t)__builtin_popcountll(mask[w]);
+  }
+  sink = hits;
+
+  if (hits != batch_hits) {
+    fprintf(stderr, "%s: batch found %" PRIu64 " primes, single %" PRIu64 "\n",
+            workload, batch_hits, hits);
+    return -1;
+  }
+  report("is_prime", workload, n, single, reps, hits);
+  report("is_prime_batch", workload, n, batch, reps, hits);
+  return 0;
+}
+
+/* Checks every factorization: ascending primes whose product is n. */
+static int
+bench_factor (char const *workload, uint64_t const *v, size_t n, uint64_t *mask, int reps)
+{
+  double ns[MAX_REPS];
+  uint64_t f[PRIMES_MAX_FACTORS], hits = 0;
+
+  (void)mask;
+  for (int r = 0; r < reps; r++)
+  {
+    double t = bench_now_ns();
+    hits = 0;
+    for (size_t i = 0; i < n; i++)
+      hits += (uint64_t)primes_factor(v[i], f);
+    ns[r] = bench_now_ns() - t;
+  }
+  sink = hits;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    int k = primes_factor(v[i], f);
+    u128 product = 1;
+    bool ok = v[i] < 2 ? k == 0 : true;
+
+    for (int j = 0; j < k; j++)
+    {
+      product *= f[j];
+      ok = ok && primes_is_prime(f[j]) && (j == 0 || f[j - 1] <= f[j]);
+    }
+    if (!ok || (v[i] >= 2 && product != v[i])) {
+      fprintf(stderr, "%s: bad factors of %" PRIu64 "\n", workload, v[i]);
+      return -1;
+    }
+  }
+  report("factor", workload, n, ns, reps, hits);
+  return 0;
+}
+
+/* The workload's words in pairs, high first: n / 2 numbers. */
+static int
+bench_is_prime128 (char const *workload, uint64_t const *v, size_t n, uint64_t *mask,
+                   int reps)
+{
+  double ns[MAX_REPS];
+  uint64_t hits = 0;
+
+  (void)mask;
+  for (int r = 0; r < reps; r++)
+  {
+    double t = bench_now_ns();
+    hits = 0;
+    for (size_t i = 0; i + 1 < n; i += 2)
+      hits += primes_is_prime128((u128)v[i] << 64 | v[i + 1]);
+    ns[r] = bench_now_ns() - t;
+  }
+  sink = hits;
+  report("is_prime128", workload, n / 2, ns, reps, hits);
+  return 0;
+}
+
+/* The n numbers from the first pair, sieved and tested as a range. The
+ * answers are checked against primes_is_prime128(). */
+static int
+bench_range128 (char const *workload, uint64_t const *v, size_t n, uint64_t *mask,
+                int reps)
+{
+  double ns[MAX_REPS];
+  u128 lo = (u128)v[0] << 64 | v[1 % n];
+  uint64_t hits = 0;
+
+  if (lo > ~(u128)0 - n)
+    lo -= n;
+  for (int r = 0; r < reps; r++)
+  {
+    double t = bench_now_ns();
+    primes_is_prime128_range(lo, n, mask);
+    ns[r] = bench_now_ns() - t;
+  }
+
+  for (size_t i = 0; i < n; i++)
+  {
+    bool in_mask = mask[i / 64] >> (i % 64) & 1;
+
+    if (in_mask != primes_is_prime128(lo + i)) {
+      fprintf(stderr, "%s: range and single tests differ at offset %zu\n", workload, i);
+      return -1;
+    }
+    hits += in_mask;
+  }
+  sink = hits;
+  report("range128", workload, n, ns, reps, hits);
+  return 0;
+}
+
+static void
+usage (char const *argv0)
+{
+  fprintf(stderr, "usage: %s [-b bench,...] [-n count] [-r reps] [-w workload,...]\n",
+          argv0);
+  fprintf(stderr, "benches:");
+  for (size_t i = 0; i < N_BENCHES; i++)
+    fprintf(stderr, " %s", benches[i].name);
+  fprintf(stderr, "\nworkloads:");
+  for (size_t i = 0; i < N_WORKLOADS; i++)
+    fprintf(stderr, " %s", workloads[i].name);
+  fprintf(stderr, "\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t n = (size_t)1 << 18;
+  int reps = 5;
+  char const *list = NULL, *bench_list = NULL;
+  uint64_t *v, *mask;
+  int rc = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:n:r:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'b':
+        bench_list = optarg;
+        break;
+      case 'n':
+        if (bench_parse_size(optarg, &n) == -1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'w':
+        list = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (reps < 1 || reps > MAX_REPS) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  v = malloc(n * sizeof(*v));
+  mask = malloc((n + 63) / 64 * sizeof(*mask));
+  if (!v || !mask) {
+    perror("malloc");
+    return 1;
+  }
+
+  printf("{\n  \"host\": {\"cpus\": %ld},\n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  \"config\": {\"n\": %zu, \"reps\": %d},\n", n, reps);
+  printf("  \"results\": [");
+
+  for (size_t w = 0; w < N_WORKLOADS; w++)
+  {
+    uint64_t rng = BENCH_SEED + w;
+
+    if (!bench_listed(list, workloads[w].name))
+      continue;
+    workloads[w].gen(v, n, &rng);
+    for (size_t b = 0; b < N_BENCHES; b++)
+      if (bench_listed(bench_list, benches[b].name)
+          && benches[b].run(workloads[w].name, v, n, mask, reps) == -1)
+        rc = 1;
+  }
+
+  printf("\n  ]\n}\n");
+  free(v);
+  free(mask);
+  return rc;
+}
@@ -1,40 +1,640 @@
-#include <stdio.h>
-#include <stdbool.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "pi.h"
+#include "primes.h"
+#include "primetab.h"
+#include "sieve.h"
+
+/*
+ * Prints or counts the primes in a range, sieved in parallel on the
+ * mod-30 wheel of sieve.h; chunks are printed in order.
+ *
+ * Text output is the primes in decimal, each followed by a space, and
+ * a newline at the end. Binary output (-b) is meant to be mapped and
+ * read front to back:
+ *
+ *   "primegap"  8 bytes
+ *   start       u64, little-endian
+ *   gaps        one LEB128 varint per prime, its distance from the
+ *               prime before, or from start for the first
+ */
+#define OUT_BUFFER_SIZE ((size_t)1 << 20)
+#define BINARY_MAGIC "primegap"
+
+/* Chunks written with one writev(). */
+#define WRITE_BATCH 32
+
+/* Threads take the range a chunk of segments at a time and restart
+ * their sieving primes at each chunk, which costs a division per prime.
+ * Counting chunks are long to amortize that; printing chunks are kept
+ * short because each is formatted in memory before its turn to write. */
+#define COUNT_CHUNK_SEGMENTS 64
+#define PRINT_CHUNK_SEGMENTS 4
+
+/* Counting with pi_count() costs about as much as sieving this many
+ * times x^(2/3) numbers. */
+#define PI_COST_FACTOR 2
+
+/* One chunk's output. In binary, the body holds the gaps after its
+ * first prime; the writer puts the gap to that in front once the
+ * previous chunk's last prime is known. */
+typedef struct Block_s {
+  char *buf;
+  size_t len, cap;
+  uint64_t first, last;        /* 0 if the chunk has no primes */
+  uint8_t head[10];
+  bool pending;                /* posted and not written, under lock */
+} Block;
 
-static bool
-is_prime (int64_t n)
+typedef struct Job_s {
+  uint64_t lo, hi;
+  uint64_t chunk_span;
+  uint64_t n_chunks;
+  bool count_only;
+  bool binary;
+  int fd;
+  atomic_uint_fast64_t next;   /* next chunk to hand out */
+  atomic_uint_fast64_t count;
+  atomic_bool failed;
+  mtx_t lock;
+  cnd_t written;
+  Block **ring;                /* posted chunks by number, under lock */
+  size_t ring_size;
+  uint64_t next_out;           /* next chunk to write, under lock */
+  bool writing;                /* someone is writing, under lock */
+  uint64_t prev;               /* last prime written, by the writer */
+} Job;
+
+/* Each worker formats into one block while the other waits its turn
+ * to be written, so workers run up to a chunk ahead of the output. */
+typedef struct Worker_s {
+  Job *job;
+  PrimeSieve s;
+  Block blocks[2];
+  int cur;
+} Worker;
+
+/* The eight decimal digits of x < 10^8, one per byte from the most
+ * significant up: split in halves, quarters and digits across the lanes
+ * of one word, dividing by multiplying. */
+static uint64_t
+digits8 (uint32_t x)
 {
-  if (n < 2)
-    return true;
+  uint64_t v = x / 10000 | (uint64_t)(x % 10000) << 32;
+  uint64_t h = (v * 10486 >> 20) & 0x0000007f0000007f;
+  uint64_t t;
+
+  v = h | (v - 100 * h) << 16;
+  t = (v * 103 >> 10) & 0x000f000f000f000f;
+  return (t | (v - 10 * t) << 8) + 0x3030303030303030;
+}
 
-  int64_t isqrt = (int64_t)(sqrt(n));
+static uint64_t const powers_of_10[20] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+  1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000,
+  100000000000000, 1000000000000000, 10000000000000000,
+  100000000000000000, 1000000000000000000, 10000000000000000000u,
+};
 
-  for (int64_t i = 2; i < isqrt; ++i)
-    if (n % i)
-      return false;
+/* Digits in v, from its bit length: log10(2) is about 1233 / 4096. */
+static unsigned
+decimal_length (uint64_t v)
+{
+  unsigned t = (unsigned)(64 - __builtin_clzll(v | 1)) * 1233 >> 12;
 
-  return true;
+  return t + 1 - ((v | 1) < powers_of_10[t]);
 }
 
-int
-main (int argc, char *argv[])
+/* Writes v in decimal and returns the end; up to eight bytes past it
+ * are clobbered. The length comes apart from the digits, so the next
+ * number need not wait for this one's. */
+static char *
+put_decimal (char *out, uint64_t v)
+{
+  unsigned len = decimal_length(v);
+  uint64_t d;
+
+  if (len <= 8) {
+    d = digits8((uint32_t)v) >> 8 * (8 - len);
+    memcpy(out, &d, 8);
+    return out + len;
+  }
+  if (len <= 16) {
+    d = digits8((uint32_t)(v / 100000000)) >> 8 * (16 - len);
+    memcpy(out, &d, 8);
+  } else {
+    d = digits8((uint32_t)(v / 10000000000000000)) >> 8 * (24 - len);
+    memcpy(out, &d, 8);
+    d = digits8((uint32_t)(v / 100000000 % 100000000));
+    memcpy(out + len - 16, &d, 8);
+  }
+  d = digits8((uint32_t)(v % 100000000));
+  memcpy(out + len - 8, &d, 8);
+  return out + len;
+}
+
+static uint8_t *
+put_varint (uint8_t *out, uint64_t v)
+{
+  for (; v >= 0x80; v >>= 7)
+    *out++ = (uint8_t)(v | 0x80);
+  *out++ = (uint8_t)v;
+  return out;
+}
+
+static int
+reserve (Block *b, size_t n)
+{
+  if (b->cap - b->len >= n)
+    return 0;
+
+  size_t cap = b->cap ? 2 * b->cap : OUT_BUFFER_SIZE;
+  char *grown;
+
+  while (cap - b->len < n)
+    cap *= 2;
+  grown = realloc(b->buf, cap);
+  if (!grown)
+    return -1;
+  b->buf = grown;
+  b->cap = cap;
+  return 0;
+}
+
+/* Appends the segment's primes to the block: text, or the varints of
+ * the gaps after the first. Stores go through locals, as the block's
+ * own fields could alias the characters. */
+static int
+format_segment (PrimeSieve const *s, Block *blk, bool binary)
+{
+  uint64_t first = blk->first, last = blk->last;
+
+  for (size_t at = 0; at < s->seg_bytes; at += 8)
+  {
+    uint64_t b;
+    char *out;
+
+    /* Room for a whole word of 20-digit numbers, their spaces and the
+     * eight bytes put_decimal() may run over. */
+    if (reserve(blk, 64 * 21 + 8) == -1)
+      return -1;
+
+    memcpy(&b, s->bytes + at, 8);
+    out = blk->buf + blk->len;
+    for (; b; b &= b - 1)
+    {
+      unsigned bit = (unsigned)__builtin_ctzll(b);
+      uint64_t p = 30 * (s->seg_base + at + bit / 8) + sieve_residues[bit % 8];
+
+      if (!binary) {
+        out = put_decimal(out, p);
+        *out++ = ' ';
+      } else if (first) {
+        out = (char *)put_varint((uint8_t *)out, p - last);
+      } else {
+        first = p;
+      }
+      last = p;
+    }
+    blk->len = (size_t)(out - blk->buf);
+  }
+  blk->first = first;
+  blk->last = last;
+  return 0;
+}
+
+/* Writes all of iov, through short writes and signals. */
+static int
+write_all (int fd, struct iovec *iov, int n)
+{
+  while (n > 0)
+  {
+    ssize_t done = writev(fd, iov, n);
+
+    if (done == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (; n > 0 && (size_t)done >= iov->iov_len; iov++, n--)
+      done -= (ssize_t)iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= (size_t)done;
+    }
+  }
+  return 0;
+}
+
+/* Hands a formatted chunk to the output. Chunks finish in any order;
+ * whoever posts the next one to write also writes every chunk queued
+ * behind it, in one writev() per batch, while the others carry on. */
+static void
+post (Job *j, uint64_t chunk, Block *b)
+{
+  mtx_lock(&j->lock);
+  b->pending = true;
+  j->ring[chunk % j->ring_size] = b;
+  if (j->writing || chunk != j->next_out) {
+    mtx_unlock(&j->lock);
+    return;
+  }
+
+  j->writing = true;
+  while (j->ring[j->next_out % j->ring_size])
+  {
+    struct iovec iov[2 * WRITE_BATCH];
+    Block *batch[WRITE_BATCH];
+    int n = 0, n_iov = 0;
+
+    for (; n < WRITE_BATCH && j->ring[(j->next_out + n) % j->ring_size]; n++)
+      batch[n] = j->ring[(j->next_out + n) % j->ring_size];
+    mtx_unlock(&j->lock);
+
+    for (int i = 0; i < n; i++)
+    {
+      Block *c = batch[i];
+
+      if (j->binary && c->first) {
+        uint8_t *end = put_varint(c->head, c->first - j->prev);
+        iov[n_iov++] = (struct iovec){ c->head, (size_t)(end - c->head) };
+        j->prev = c->last;
+      }
+      if (c->len > 0)
+        iov[n_iov++] = (struct iovec){ c->buf, c->len };
+    }
+    if (!atomic_load(&j->failed) && write_all(j->fd, iov, n_iov) == -1)
+      atomic_store(&j->failed, true);
+
+    mtx_lock(&j->lock);
+    for (int i = 0; i < n; i++)
+    {
+      j->ring[j->next_out % j->ring_size] = NULL;
+      j->next_out++;
+      batch[i]->pending = false;
+    }
+    cnd_broadcast(&j->written);
+  }
+  j->writing = false;
+  mtx_unlock(&j->lock);
+}
+
+static int
+worker (void *arg)
+{
+  Worker *w = arg;
+  Job *j = w->job;
+  uint64_t c;
+
+  for (;;)
+  {
+    Block *b = &w->blocks[w->cur];
+    uint64_t lo, hi, n = 0;
+
+    /* The block must be free before the chunk is claimed: then every
+     * chunk from next_out up is held by a worker, two at most each, and
+     * they all fit in the ring. */
+    if (!j->count_only) {
+      mtx_lock(&j->lock);
+      while (b->pending)
+        cnd_wait(&j->written, &j->lock);
+      mtx_unlock(&j->lock);
+      b->len = 0;
+      b->first = b->last = 0;
+    }
+    if ((c = atomic_fetch_add(&j->next, 1)) >= j->n_chunks)
+      break;
+    lo = j->lo + c * j->chunk_span;
+    hi = j->hi - lo <= j->chunk_span ? j->hi : lo + j->chunk_span;
+
+    sieve_range(&w->s, lo, hi);
+    while (sieve_segment(&w->s))
+    {
+      if (j->count_only)
+        n += sieve_count(&w->s);
+      else if (format_segment(&w->s, b, j->binary) == -1)
+        atomic_store(&j->failed, true);
+    }
+
+    if (j->count_only) {
+      atomic_fetch_add(&j->count, n);
+    } else {
+      post(j, c, b);
+      w->cur ^= 1;
+    }
+  }
+  return 0;
+}
+
+/* Runs the job on n_threads workers, this thread being one of them. */
+static int
+run (Job *j, uint32_t const *primes, size_t n_primes, size_t bytes, long n_threads)
 {
-  assert( argc == 2 );
+  Worker *workers = calloc((size_t)n_threads, sizeof(*workers));
+  thrd_t *threads = calloc((size_t)n_threads, sizeof(*threads));
+  long ready = 0, started = 1;
+  int rc = 0;
+
+  if (!workers || !threads) {
+    free(workers);
+    free(threads);
+    return -1;
+  }
+  for (; ready < n_threads; ready++)
+  {
+    workers[ready].job = j;
+    if (sieve_init(&workers[ready].s, primes, n_primes, bytes) == -1)
+      break;
+  }
+  if (ready == 0)
+    rc = -1;
+
+  for (; rc == 0 && started < ready; started++)
+    if (thrd_create(&threads[started], worker, &workers[started]) != thrd_success)
+      break;
 
-  int n = atoi(argv[1]);
+  if (rc == 0)
+    worker(&workers[0]);
+  for (long t = 1; t < started; t++)
+    thrd_join(threads[t], NULL);
 
-  for (int64_t i = 0; i < (int64_t)(n); ++i)
+  for (long t = 0; t < ready; t++)
   {
-    if (is_prime(i))
-      printf("%"PRIi64" ");
+    sieve_free(&workers[t].s);
+    free(workers[t].blocks[0].buf);
+    free(workers[t].blocks[1].buf);
   }
+  free(workers);
+  free(threads);
+  return rc;
+}
+
+static int
+parse_u64 (char const *s, uint64_t *out)
+{
+  char *end;
+
+  errno = 0;
+  *out = strtoull(s, &end, 10);
+  return errno || end == s || *end || *s == '-' ? -1 : 0;
+}
 
-  printf("\n");
+/* Decimal, up to 2^128 - 1. */
+static int
+parse_u128 (char const *s, primes_u128 *out)
+{
+  primes_u128 v = 0;
 
+  if (!*s)
+    return -1;
+  for (; *s; s++)
+  {
+    if (*s < '0' || *s > '9' || v > (~(primes_u128)0 - (unsigned)(*s - '0')) / 10)
+      return -1;
+    v = v * 10 + (unsigned)(*s - '0');
+  }
+  *out = v;
   return 0;
 }
 
+/* n in decimal into buf, which holds 40 bytes. */
+static char *
+format_u128 (char *buf, primes_u128 n)
+{
+  char *p = buf + 39;
+
+  *p = '\0';
+  do
+  {
+    *--p = (char)('0' + (unsigned)(n % 10));
+    n /= 10;
+  } while (n);
+  return p;
+}
+
+/* Counts [lo, hi) as pi(hi - 1) - pi(lo - 1) if that beats sieving;
+ * returns 1 if it does not. */
+static int
+count_by_pi (uint64_t lo, uint64_t hi, unsigned n_threads, uint64_t *count)
+{
+  double cost = PI_COST_FACTOR * pow((double)hi, 2.0 / 3) * (lo > 1 ? 2 : 1);
+  uint64_t below = 0;
+
+  if (hi <= lo || (double)(hi - lo) < cost)
+    return 1;
+  if (pi_count(hi - 1, n_threads, count) == -1
+      || (lo > 1 && pi_count(lo - 1, n_threads, &below) == -1))
+    return -1;
+  *count -= below;
+  return 0;
+}
+
+static void
+usage (char const *argv0)
+{
+  fprintf(stderr, "usage: %s [-b | -c] [-j threads] [start] stop\n"
+                  "       %s -t n...\n"
+                  "       %s -n [-j threads] n...\n"
+                  "       %s -w table [-j threads] stop\n", argv0, argv0, argv0, argv0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t lo = 0, hi, root;
+  uint32_t *primes;
+  size_t n_primes, bytes;
+  uint64_t below_7 = 0;
+  Job j = { 0 };
+  char head[64], *out = head;
+  char const *table = NULL;
+  uint64_t count;
+  int query = 0;
+  int opt, rc;
+
+  while ((opt = getopt(argc, argv, "bcj:ntw:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'b':
+        j.binary = true;
+        break;
+
+      case 'c':
+        j.count_only = true;
+        break;
+
+      case 'j':
+        n_threads = atol(optarg);
+        break;
+
+      case 'n':
+      case 't':
+        query = opt;
+        break;
+
+      case 'w':
+        table = optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  /* Point queries: each argument on its own. */
+  if (query) {
+    if (optind == argc || n_threads < 1 || n_threads > SIEVE_MAX_THREADS) {
+      usage(argv[0]);
+      return 1;
+    }
+    for (int i = optind; i < argc; i++)
+    {
+      uint64_t n, p;
+      if (query == 't') {
+        primes_u128 t;
+        char buf[40];
+        if (parse_u128(argv[i], &t) == -1) {
+          fprintf(stderr, "%s: not a 128-bit number\n", argv[i]);
+          return 1;
+        }
+        printf("%s %s\n", format_u128(buf, t), primes_is_prime128(t) ? "prime" : "not prime");
+        continue;
+      }
+      if (parse_u64(argv[i], &n) == -1) {
+        fprintf(stderr, "%s: not a 64-bit number\n", argv[i]);
+        return 1;
+      }
+      if (pi_nth(n, (unsigned)n_threads, &p) == -1) {
+        if (errno == EDOM)
+          fprintf(stderr, "%s: no such prime below 2^64\n", argv[i]);
+        else
+          perror("pi");
+        return 1;
+      }
+      printf("%" PRIu64 "\n", p);
+    }
+    return 0;
+  }
+
+  if (argc - optind < 1 || argc - optind > 2
+      || (argc - optind == 2 && parse_u64(argv[optind], &lo) == -1)
+      || parse_u64(argv[argc - 1], &hi) == -1
+      || n_threads < 1 || n_threads > SIEVE_MAX_THREADS) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* A table of the primes below stop, for primetab.h to map. */
+  if (table) {
+    if (argc - optind != 1) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (primetab_build(table, hi, (unsigned)n_threads) == -1) {
+      perror(table);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (j.count_only
+      && (rc = count_by_pi(lo, hi, (unsigned)n_threads, &count)) != 1) {
+    if (rc == -1) {
+      perror("pi");
+      return 1;
+    }
+    printf("%" PRIu64 "\n", count);
+    return fflush(stdout) == EOF;
+  }
+
+  root = hi > 0 ? sieve_isqrt(hi - 1) : 0;
+  bytes = sieve_segment_bytes(root);
+  if (sieve_small_primes(root, &primes, &n_primes) == -1) {
+    perror("sieve");
+    return 1;
+  }
+
+  j.lo = lo;
+  j.hi = hi;
+  j.chunk_span = (uint64_t)bytes * 30 * (j.count_only ? COUNT_CHUNK_SEGMENTS
+                                                      : PRINT_CHUNK_SEGMENTS);
+  j.n_chunks = lo < hi ? (hi - lo) / j.chunk_span + ((hi - lo) % j.chunk_span != 0) : 0;
+  j.fd = STDOUT_FILENO;
+  j.ring_size = 2 * (size_t)n_threads;
+  j.ring = calloc(j.ring_size, sizeof(*j.ring));
+  j.prev = lo;
+  atomic_init(&j.next, 0);
+  atomic_init(&j.count, 0);
+  atomic_init(&j.failed, false);
+  mtx_init(&j.lock, mtx_plain);
+  cnd_init(&j.written);
+  if (!j.ring) {
+    perror("output");
+    return 1;
+  }
+
+  /* The header, and 2, 3 and 5, which are off the wheel. */
+  if (j.binary) {
+    memcpy(out, BINARY_MAGIC, 8);
+    for (int i = 0; i < 8; i++)
+      out[8 + i] = (char)(lo >> 8 * i);
+    out += 16;
+  }
+  for (uint64_t p = 2; p < 7; p += p < 3 ? 1 : 2)
+    if (lo <= p && p < hi) {
+      if (j.binary) {
+        out = (char *)put_varint((uint8_t *)out, p - j.prev);
+      } else {
+        out = put_decimal(out, p);
+        *out++ = ' ';
+      }
+      j.prev = p;
+      below_7++;
+    }
+
+#ifdef F_SETPIPE_SZ
+  /* A pipe's default 64K would split every write into many. */
+  if (!j.count_only)
+    fcntl(j.fd, F_SETPIPE_SZ, (int)OUT_BUFFER_SIZE);
+#endif
+  if (!j.count_only
+      && write_all(j.fd, &(struct iovec){ head, (size_t)(out - head) }, 1) == -1) {
+    perror("output");
+    return 1;
+  }
+
+  if (run(&j, primes, n_primes, bytes, n_threads) == -1) {
+    perror("sieve");
+    return 1;
+  }
+
+  if (j.count_only)
+    printf("%" PRIu64 "\n", below_7 + (uint64_t)atomic_load(&j.count));
+  else if (!j.binary && write_all(j.fd, &(struct iovec){ "\n", 1 }, 1) == -1)
+    atomic_store(&j.failed, true);
+
+  mtx_destroy(&j.lock);
+  cnd_destroy(&j.written);
+  free(j.ring);
+  free(primes);
+
+  if (atomic_load(&j.failed) || fflush(stdout) == EOF) {
+    perror("output");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "primetab.h"
+#include "sieve.h"
+
+#define PAGE_BYTES 4096
+#define CHUNK_SEGMENTS 16
+
+/* Threads take the table a chunk of segments at a time and write each
+ * segment and its block counts where they belong, in any order. */
+typedef struct Build_s {
+  int fd;
+  uint64_t stop;
+  uint64_t end_byte;   /* the bits cover [0, 30 end_byte) */
+  uint64_t bits_offset;
+  uint64_t *ranks;     /* per block: its primes, then those before it */
+  uint32_t const *primes;
+  size_t n_primes;
+  size_t seg_bytes;
+  uint64_t chunk_bytes;
+  uint64_t n_chunks;
+  atomic_uint_fast64_t next;
+  atomic_int error;
+} Build;
+
+static int
+write_at (int fd, void const *buf, size_t n, uint64_t off)
+{
+  while (n > 0)
+  {
+    ssize_t w = pwrite(fd, buf, n, (off_t)off);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf = (char const *)buf + w;
+    n -= (size_t)w;
+    off += (uint64_t)w;
+  }
+  return 0;
+}
+
+static int
+build_worker (void *arg)
+{
+  Build *b = arg;
+  PrimeSieve s;
+  uint64_t c;
+
+  if (sieve_init(&s, b->primes, b->n_primes, b->seg_bytes) == -1) {
+    atomic_store(&b->error, ENOMEM);
+    return 0;
+  }
+
+  while (atomic_load(&b->error) == 0
+         && (c = atomic_fetch_add(&b->next, 1)) < b->n_chunks)
+  {
+    uint64_t lo = c * b->chunk_bytes;
+    uint64_t hi = b->end_byte - lo <= b->chunk_bytes ? b->stop : 30 * (lo + b->chunk_bytes);
+
+    sieve_range(&s, 30 * lo, hi);
+    while (sieve_segment(&s))
+    {
+      /* Segments start on a block; only the last may end inside one,
+       * and sieve_segment() zeroed it to the next word. */
+      for (size_t at = 0; at < s.seg_bytes; at += PRIMETAB_BLOCK_BYTES)
+      {
+        size_t end = s.seg_bytes - at < PRIMETAB_BLOCK_BYTES ? s.seg_bytes
+                                                             : at + PRIMETAB_BLOCK_BYTES;
+        uint64_t n = 0;
+
+        for (size_t i = at / 8; i < (end + 7) / 8; i++)
+          n += (uint64_t)__builtin_popcountll(sieve_word(s.bytes, 8 * i));
+        b->ranks[(s.seg_base + at) / PRIMETAB_BLOCK_BYTES] = n;
+      }
+      if (write_at(b->fd, s.bytes, s.seg_bytes, b->bits_offset + s.seg_base) == -1) {
+        atomic_store(&b->error, errno);
+        break;
+      }
+    }
+  }
+  sieve_free(&s);
+  return 0;
+}
+
+/* Runs the chunks on n_threads workers, this thread being one of them. */
+static int
+run (Build *b, unsigned n_threads)
+{
+  sieve_run(build_worker, b, 0, n_threads);
+  if (atomic_load(&b->error) != 0) {
+    errno = atomic_load(&b->error);
+    return -1;
+  }
+  return 0;
+}
+
+/* Of 2, 3 and 5, how many are below stop. */
+static uint64_t
+small_below (uint64_t stop)
+{
+  return (stop > 2) + (stop > 3) + (stop > 5);
+}
+
+static int
+write_table (Build *b, unsigned n_threads)
+{
+  PrimeTableHeader h = { .version = PRIMETAB_VERSION,
+                         .block_bytes = PRIMETAB_BLOCK_BYTES,
+                         .stop = b->stop };
+  uint64_t root = b->stop > 0 ? sieve_isqrt(b->stop - 1) : 0;
+  uint64_t total = 0;
+  uint32_t *primes;
+
+  memcpy(h.magic, PRIMETAB_MAGIC, 8);
+  h.n_blocks = b->end_byte / PRIMETAB_BLOCK_BYTES + 1;
+  h.bits_offset = (sizeof(h) + h.n_blocks * 8 + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+
+  b->bits_offset = h.bits_offset;
+  b->ranks = calloc(h.n_blocks, sizeof(*b->ranks));
+  if (!b->ranks || sieve_small_primes(root, &primes, &b->n_primes) == -1) {
+    errno = ENOMEM;
+    return -1;
+  }
+  b->primes = primes;
+  b->seg_bytes = sieve_segment_bytes(root);
+  b->chunk_bytes = (uint64_t)b->seg_bytes * CHUNK_SEGMENTS;
+  b->n_chunks = b->end_byte / b->chunk_bytes + (b->end_byte % b->chunk_bytes != 0);
+
+  if (ftruncate(b->fd, (off_t)(h.bits_offset + h.n_blocks * PRIMETAB_BLOCK_BYTES)) == -1
+      || run(b, n_threads) == -1) {
+    free(primes);
+    return -1;
+  }
+  free(primes);
+
+  for (uint64_t k = 0; k < h.n_blocks; k++)
+  {
+    uint64_t n = b->ranks[k];
+    b->ranks[k] = total;
+    total += n;
+  }
+  h.count = total + small_below(b->stop);
+
+  /* The header goes last: until it is there, the file is no table. */
+  if (write_at(b->fd, b->ranks, h.n_blocks * 8, sizeof(h)) == -1
+      || write_at(b->fd, &h, sizeof(h), 0) == -1
+      || fsync(b->fd) == -1)
+    return -1;
+  return 0;
+}
+
+int
+primetab_build (char const *path, uint64_t stop, unsigned n_threads)
+{
+  Build b = { .stop = stop };
+  size_t len = strlen(path);
+  char *tmp = malloc(len + 5);
+  int rc, saved;
+
+  if (!tmp)
+    return -1;
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".tmp", 5);
+
+  b.end_byte = stop / 30 + (stop % 30 != 0);
+  atomic_init(&b.next, 0);
+  atomic_init(&b.error, 0);
+  b.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (b.fd == -1) {
+    free(tmp);
+    return -1;
+  }
+
+  rc = write_table(&b, sieve_threads(n_threads));
+  saved = errno;
+  if (close(b.fd) == -1 && rc == 0) {
+    saved = errno;
+    rc = -1;
+  }
+  if (rc == 0 && rename(tmp, path) == -1) {
+    saved = errno;
+    rc = -1;
+  }
+  if (rc == -1)
+    unlink(tmp);
+
+  free(b.ranks);
+  free(tmp);
+  errno = saved;
+  return rc;
+}
+
+int
+primetab_open (PrimeTable *t, char const *path)
+{
+  PrimeTableHeader h;
+  struct stat st;
+  void *map;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if ((uint64_t)st.st_size < sizeof(h)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  memcpy(&h, map, sizeof(h));
+  if (memcmp(h.magic, PRIMETAB_MAGIC, 8) || h.version != PRIMETAB_VERSION
+      || h.block_bytes != PRIMETAB_BLOCK_BYTES
+      || h.n_blocks != (h.stop / 30 + (h.stop % 30 != 0)) / PRIMETAB_BLOCK_BYTES + 1
+      || h.bits_offset % PAGE_BYTES || h.bits_offset < sizeof(h) + h.n_blocks * 8
+      || (uint64_t)st.st_size - h.bits_offset != h.n_blocks * PRIMETAB_BLOCK_BYTES) {
+    munmap(map, (size_t)st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  sieve_tables_init();
+
+  /* Queries jump about; reading ahead would only fault in pages that
+   * are not asked for. */
+  madvise(map, (size_t)st.st_size, MADV_RANDOM);
+
+  t->map = map;
+  t->map_bytes = (size_t)st.st_size;
+  t->stop = h.stop;
+  t->count = h.count;
+  t->n_blocks = h.n_blocks;
+  t->ranks = (uint64_t const *)((char const *)map + sizeof(h));
+  t->bits = (uint8_t const *)map + h.bits_offset;
+  return 0;
+}
+
+void
+primetab_close (PrimeTable *t)
+{
+  munmap(t->map, t->map_bytes);
+  memset(t, 0, sizeof(*t));
+}
+
+/* Primes up to n, for n below stop. */
+static uint64_t
+count_upto (PrimeTable const *t, uint64_t n)
+{
+  uint64_t byte = n / 30, block = byte / PRIMETAB_BLOCK_BYTES;
+  uint8_t const *bits = t->bits + block * PRIMETAB_BLOCK_BYTES;
+  size_t in_block = (size_t)(byte % PRIMETAB_BLOCK_BYTES);
+  uint64_t count = t->ranks[block] + small_below(n + 1);
+  uint64_t last = sieve_word(bits, in_block & ~(size_t)7);
+
+  for (size_t i = 0; i < in_block / 8; i++)
+    count += (uint64_t)__builtin_popcountll(sieve_word(bits, 8 * i));
+
+  /* The whole bytes before n's in its word, then n's up to n. */
+  last &= ((uint64_t)1 << 8 * (in_block % 8)) - 1;
+  last |= (uint64_t)(bits[in_block] & sieve_upto[n % 30]) << 8 * (in_block % 8);
+  return count + (uint64_t)__builtin_popcountll(last);
+}
+
+int
+primetab_count (PrimeTable const *t, uint64_t lo, uint64_t hi, uint64_t *count)
+{
+  if (hi > t->stop) {
+    errno = ERANGE;
+    return -1;
+  }
+  *count = hi > lo ? count_upto(t, hi - 1) - (lo > 0 ? count_upto(t, lo - 1) : 0) : 0;
+  return 0;
+}
+
+int
+primetab_next (PrimeTable const *t, uint64_t n, uint64_t *p)
+{
+  uint64_t byte = (n + 1) / 30, end = t->stop / 30 + (t->stop % 30 != 0);
+  unsigned r = (unsigned)((n + 1) % 30), m;
+
+  if (t->stop == 0 || n >= t->stop - 1) {
+    errno = ERANGE;
+    return -1;
+  }
+  if (n < 7) {
+    *p = n < 2 ? 2 : n < 3 ? 3 : n < 5 ? 5 : 7;
+  } else {
+    m = t->bits[byte] & (r ? (unsigned)(uint8_t)~sieve_upto[r - 1] : 0xffu);
+    while (!m && ++byte < end)
+      m = t->bits[byte];
+    if (!m) {
+      errno = ERANGE;
+      return -1;
+    }
+    *p = 30 * byte + sieve_residues[__builtin_ctz(m)];
+  }
+  if (*p >= t->stop) {
+    errno = ERANGE;
+    return -1;
+  }
+  return 0;
+}
+
+int
+primetab_prev (PrimeTable const *t, uint64_t n, uint64_t *p)
+{
+  uint64_t byte = (n - 1) / 30;
+  unsigned m;
+
+  if (n <= 2) {
+    errno = EDOM;
+    return -1;
+  }
+  if (n > t->stop) {
+    errno = ERANGE;
+    return -1;
+  }
+  if (n <= 7) {
+    *p = n <= 3 ? 2 : n <= 5 ? 3 : 5;
+    return 0;
+  }
+
+  /* 7 is in byte 0, so this stops there at the latest. */
+  m = t->bits[byte] & sieve_upto[(n - 1) % 30];
+  while (!m)
+    m = t->bits[--byte];
+  *p = 30 * byte + sieve_residues[31 - __builtin_clz(m)];
+  return 0;
+}
+
+int
+primetab_nth (PrimeTable const *t, uint64_t n, uint64_t *p)
+{
+  uint64_t lo = 0, hi = t->n_blocks, k;
+  uint8_t const *bits;
+  uint64_t w;
+  size_t i = 0;
+
+  if (n == 0) {
+    errno = EDOM;
+    return -1;
+  }
+  if (n > t->count) {
+    errno = ERANGE;
+    return -1;
+  }
+  if (n <= 3) {
+    *p = n == 1 ? 2 : n == 2 ? 3 : 5;
+    return 0;
+  }
+
+  /* The last block with fewer than k wheel primes before it. */
+  k = n - 3;
+  while (hi - lo > 1)
+  {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (t->ranks[mid] < k)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  k -= t->ranks[lo];
+  bits = t->bits + lo * PRIMETAB_BLOCK_BYTES;
+
+  for (;; i++)
+  {
+    uint64_t c;
+
+    w = sieve_word(bits, 8 * i);
+    c = (uint64_t)__builtin_popcountll(w);
+    if (k <= c)
+      break;
+    k -= c;
+  }
+  while (--k > 0)
+    w &= w - 1;
+
+  k = (uint64_t)__builtin_ctzll(w);
+  *p = 30 * (lo * PRIMETAB_BLOCK_BYTES + 8 * i + k / 8) + sieve_residues[k % 8];
+  return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __primetab_h__
+#define __primetab_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A file of the primes below some stop, built once and mapped by every
+ * process that asks about them. Queries touch a few cache lines of the
+ * map and nothing else, so opening one costs a page fault per page
+ * actually read.
+ *
+ *   primetab_build("primes.tab", 10000000000, 0);
+ *
+ *   PrimeTable t;
+ *   uint64_t p, n;
+ *   primetab_open(&t, "primes.tab");
+ *   primetab_next(&t, 1000000000, &p);         p = 1000000007
+ *   primetab_count(&t, 0, 1000000000, &n);     n = 50847534
+ *   primetab_close(&t);
+ *
+ * The file holds the mod-30 wheel bytes of sieve.h, one bit per number
+ * coprime to 30, and before them the count of primes ahead of every
+ * 256-byte block:
+ *
+ *   header      PrimeTableHeader
+ *   ranks       u64 per block: wheel primes (from 7) before it
+ *   bits        from a page boundary, zero-padded to whole blocks
+ *
+ * Numbers are in the byte order of the machine that built it; another
+ * byte order fails the version check.
+ */
+#define PRIMETAB_MAGIC "primetab"
+#define PRIMETAB_VERSION 1
+#define PRIMETAB_BLOCK_BYTES 256
+
+typedef struct PrimeTableHeader_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_bytes;
+  uint64_t stop;       /* primes below this */
+  uint64_t count;      /* of them, 2, 3 and 5 included */
+  uint64_t n_blocks;
+  uint64_t bits_offset;
+} PrimeTableHeader;
+
+typedef struct PrimeTable_s {
+  void *map;
+  size_t map_bytes;
+  uint64_t stop;
+  uint64_t count;
+  uint64_t n_blocks;
+  uint64_t const *ranks;
+  uint8_t const *bits;
+} PrimeTable;
+
+/* Sieves the primes below stop into a table at path, on n_threads
+ * threads (0 for one per online CPU). The file is written beside path
+ * and renamed over it, so readers never see half of one. Returns -1
+ * with errno set on failure. */
+int primetab_build(char const *path, uint64_t stop, unsigned n_threads);
+
+/* Maps a table read-only. Returns -1 with errno set, EINVAL if the file
+ * is not a table. */
+int primetab_open(PrimeTable *t, char const *path);
+void primetab_close(PrimeTable *t);
+
+/*
+ * The queries return -1 with errno ERANGE if the answer depends on
+ * primes at or past the table's stop, or EDOM if there is none.
+ */
+
+/* The smallest prime above n. */
+int primetab_next(PrimeTable const *t, uint64_t n, uint64_t *p);
+
+/* The largest prime below n. */
+int primetab_prev(PrimeTable const *t, uint64_t n, uint64_t *p);
+
+/* The primes in [lo, hi). */
+int primetab_count(PrimeTable const *t, uint64_t lo, uint64_t hi, uint64_t *count);
+
+/* The n-th prime, counting 2 as the first. */
+int primetab_nth(PrimeTable const *t, uint64_t n, uint64_t *p);
+
+#endif /* !defined(__primetab_h__) */
@@ -0,0 +1,328 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "sieve.h"
+
+uint8_t const sieve_residues[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+int8_t sieve_class[30];
+uint8_t sieve_gap[30];
+uint8_t sieve_upto[30];
+SieveStep sieve_steps[64];
+uint8_t sieve_presieve[SIEVE_PRESIEVE_BYTES];
+
+static once_flag tables_once = ONCE_FLAG_INIT;
+
+static void
+build_tables (void)
+{
+  for (int r = 0; r < 30; r++)
+    sieve_class[r] = -1;
+  for (int k = 0; k < 8; k++)
+    sieve_class[sieve_residues[k]] = (int8_t)k;
+  for (int r = 0; r < 30; r++)
+  {
+    int d = 0;
+    while (sieve_class[(r + d) % 30] < 0)
+      d++;
+    sieve_gap[r] = (uint8_t)d;
+    for (int k = 0; k < 8; k++)
+      if (sieve_residues[k] <= r)
+        sieve_upto[r] |= (uint8_t)(1u << k);
+  }
+
+  /* For p = 30q + r and m = 30k + w, p * m lands in byte
+   * 30qk + qw + rk + rw / 30 at the bit for rw mod 30. */
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 8; j++)
+    {
+      unsigned r = sieve_residues[i], w = sieve_residues[j];
+      unsigned w_next = j < 7 ? sieve_residues[j + 1] : 31;
+      SieveStep *e = &sieve_steps[8 * i + j];
+
+      e->clear = (uint8_t)~(1u << sieve_class[r * w % 30]);
+      e->dq = (uint8_t)(w_next - w);
+      e->dc = (uint8_t)(r * w_next / 30 - r * w / 30);
+      e->next = (uint8_t)(8 * i + (j + 1) % 8);
+    }
+
+  for (int b = 0; b < SIEVE_PRESIEVE_BYTES; b++)
+  {
+    sieve_presieve[b] = 0xff;
+    for (int k = 0; k < 8; k++)
+    {
+      unsigned n = 30 * (unsigned)b + sieve_residues[k];
+      if (n % 7 == 0 || n % 11 == 0 || n % 13 == 0)
+        sieve_presieve[b] &= (uint8_t)~(1u << k);
+    }
+  }
+}
+
+void
+sieve_tables_init (void)
+{
+  call_once(&tables_once, build_tables);
+}
+
+uint64_t
+sieve_isqrt (uint64_t n)
+{
+  uint64_t r = (uint64_t)sqrtl((long double)n);
+
+  while (r > 0 && (r > UINT32_MAX || r * r > n))
+    r--;
+  while (r < UINT32_MAX && (r + 1) * (r + 1) <= n)
+    r++;
+  return r;
+}
+
+int
+sieve_small_primes (uint64_t limit, uint32_t **out, size_t *n_out)
+{
+  size_t n_odd = (size_t)(limit / 2) + 1;
+  uint8_t *composite = calloc(n_odd / 8 + 1, 1);
+  size_t n = 0, cap = 1024;
+  uint32_t *primes = malloc(cap * sizeof(*primes));
+
+  if (!composite || !primes) {
+    free(composite);
+    free(primes);
+    return -1;
+  }
+
+  /* Bit i of composite stands for 2i + 1. */
+  for (size_t i = 1; i < n_odd; i++)
+  {
+    if (composite[i / 8] >> (i % 8) & 1)
+      continue;
+
+    uint64_t p = 2 * i + 1;
+    if (p > limit)
+      break;
+    if (n == cap) {
+      uint32_t *grown = realloc(primes, 2 * cap * sizeof(*primes));
+      if (!grown) {
+        free(composite);
+        free(primes);
+        return -1;
+      }
+      primes = grown;
+      cap *= 2;
+    }
+    primes[n++] = (uint32_t)p;
+    for (uint64_t j = p * p / 2; j < n_odd; j += p)
+      composite[j / 8] |= (uint8_t)(1 << (j % 8));
+  }
+
+  free(composite);
+  *out = primes;
+  *n_out = n;
+  return 0;
+}
+
+/* L1-sized while the sieving primes are small; past that, grow into L2
+ * so that most sieving primes still land in every segment. */
+size_t
+sieve_segment_bytes (uint64_t root)
+{
+  size_t bytes = SIEVE_MIN_BYTES;
+
+  while (bytes < SIEVE_MAX_BYTES && bytes * 30 < root)
+    bytes *= 2;
+  return bytes;
+}
+
+void
+sieve_free (PrimeSieve *s)
+{
+  free(s->bytes);
+  free(s->offs);
+  free(s->wheel);
+}
+
+int
+sieve_init (PrimeSieve *s, uint32_t const *primes, size_t n_primes, size_t bytes)
+{
+  sieve_tables_init();
+  while (n_primes > 0 && *primes < SIEVE_FIRST_PRIME)
+  {
+    primes++;
+    n_primes--;
+  }
+
+  memset(s, 0, sizeof(*s));
+  s->primes = primes;
+  s->n_primes = n_primes;
+  s->max_bytes = bytes;
+  s->bytes = malloc(bytes);
+  s->offs = malloc((n_primes ? n_primes : 1) * sizeof(*s->offs));
+  s->wheel = malloc(n_primes ? n_primes : 1);
+  if (!s->bytes || !s->offs || !s->wheel) {
+    sieve_free(s);
+    return -1;
+  }
+  return 0;
+}
+
+void
+sieve_range (PrimeSieve *s, uint64_t lo, uint64_t hi)
+{
+  s->lo = lo;
+  s->hi = hi;
+  s->active = 0;
+}
+
+uint64_t
+sieve_first_multiple (uint64_t p, uint64_t base, uint8_t *wheel)
+{
+  uint64_t m = 30 * base / p;
+
+  if (m * p < 30 * base)
+    m++;
+  if (m < p)
+    m = p;
+  m += sieve_gap[m % 30];
+  *wheel = (uint8_t)(8 * sieve_class[p % 30] + sieve_class[m % 30]);
+  return m > UINT64_MAX / p ? UINT64_MAX : p * m / 30 - base;
+}
+
+/* Crosses off the multiples of the active primes in one segment. */
+static void
+cross_off (PrimeSieve *s)
+{
+  uint8_t *seg = s->bytes;
+  uint64_t n = s->seg_bytes;
+
+  for (size_t i = 0; i < s->active; i++)
+  {
+    uint64_t p = s->primes[i], q = p / 30, idx = s->offs[i];
+    unsigned wi = s->wheel[i];
+
+    /* Eight multiples make one turn of the wheel and exactly p bytes,
+     * so whole turns are a fixed pattern of offsets and masks. */
+    if (p <= n && idx <= n - p) {
+      uint64_t o[8];
+      uint8_t c[8];
+      unsigned k = wi;
+
+      for (uint64_t t = 0, at = 0; t < 8; t++)
+      {
+        o[t] = at;
+        c[t] = sieve_steps[k].clear;
+        at += q * sieve_steps[k].dq + sieve_steps[k].dc;
+        k = sieve_steps[k].next;
+      }
+      for (; idx <= n - p; idx += p)
+      {
+        seg[idx + o[0]] &= c[0];
+        seg[idx + o[1]] &= c[1];
+        seg[idx + o[2]] &= c[2];
+        seg[idx + o[3]] &= c[3];
+        seg[idx + o[4]] &= c[4];
+        seg[idx + o[5]] &= c[5];
+        seg[idx + o[6]] &= c[6];
+        seg[idx + o[7]] &= c[7];
+      }
+    }
+
+    while (idx < n)
+    {
+      SieveStep const *e = &sieve_steps[wi];
+
+      seg[idx] &= e->clear;
+      idx += q * e->dq + e->dc;
+      wi = e->next;
+    }
+
+    s->offs[i] = idx - n;
+    s->wheel[i] = (uint8_t)wi;
+  }
+}
+
+bool
+sieve_segment (PrimeSieve *s)
+{
+  uint64_t end;
+
+  if (s->lo >= s->hi)
+    return false;
+
+  /* Bytes holding [lo, hi), without forming 30 * byte past hi. */
+  s->seg_base = s->lo / 30;
+  end = s->hi / 30 + (s->hi % 30 != 0);
+  s->seg_bytes = end - s->seg_base < s->max_bytes ? (size_t)(end - s->seg_base) : s->max_bytes;
+
+  for (size_t at = 0, from = (size_t)(s->seg_base % SIEVE_PRESIEVE_BYTES); at < s->seg_bytes; )
+  {
+    size_t n = SIEVE_PRESIEVE_BYTES - from < s->seg_bytes - at ? SIEVE_PRESIEVE_BYTES - from
+                                                               : s->seg_bytes - at;
+    memcpy(s->bytes + at, sieve_presieve + from, n);
+    at += n;
+    from = 0;
+  }
+  memset(s->bytes + s->seg_bytes, 0, (8 - s->seg_bytes % 8) % 8);
+  if (s->seg_base == 0)
+    s->bytes[0] = (s->bytes[0] & ~1u) | 0x0e;    /* 1 out, 7 11 13 back */
+
+  /* Clip the first and last bytes to the range. */
+  for (int k = 0; k < 8; k++)
+  {
+    if (30 * s->seg_base + sieve_residues[k] < s->lo)
+      s->bytes[0] &= (uint8_t)~(1u << k);
+    if (s->seg_base + s->seg_bytes == end
+        && sieve_residues[k] >= s->hi - 30 * (end - 1))
+      s->bytes[s->seg_bytes - 1] &= (uint8_t)~(1u << k);
+  }
+
+  while (s->active < s->n_primes
+         && (uint64_t)s->primes[s->active] * s->primes[s->active] / 30
+            < s->seg_base + s->seg_bytes)
+  {
+    s->offs[s->active] = sieve_first_multiple(s->primes[s->active], s->seg_base,
+                                              &s->wheel[s->active]);
+    s->active++;
+  }
+  cross_off(s);
+
+  s->lo = s->seg_base + s->seg_bytes == end ? s->hi : 30 * (s->seg_base + s->seg_bytes);
+  return true;
+}
+
+uint64_t
+sieve_count (PrimeSieve const *s)
+{
+  uint64_t n = 0;
+
+  for (size_t at = 0; at < s->seg_bytes; at += 8)
+    n += (uint64_t)__builtin_popcountll(sieve_word(s->bytes, at));
+  return n;
+}
+
+unsigned
+sieve_threads (unsigned n_threads)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n_threads == 0)
+    n_threads = n > 0 ? (unsigned)n : 1;
+  return n_threads < SIEVE_MAX_THREADS ? n_threads : SIEVE_MAX_THREADS;
+}
+
+unsigned
+sieve_run (int (*fn)(void *), void *arg, size_t stride, unsigned n_threads)
+{
+  thrd_t threads[SIEVE_MAX_THREADS];
+  unsigned started = 1;
+
+  if (n_threads > SIEVE_MAX_THREADS)
+    n_threads = SIEVE_MAX_THREADS;
+  for (; started < n_threads; started++)
+    if (thrd_create(&threads[started], fn, (char *)arg + started * stride) != thrd_success)
+      break;
+
+  fn(arg);
+  for (unsigned t = 1; t < started; t++)
+    thrd_join(threads[t], NULL);
+  return started;
+}
@@ -0,0 +1,119 @@
+#ifndef __sieve_h__
+#define __sieve_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Segmented sieve of Eratosthenes on a mod-30 wheel: byte i of a
+ * segment stands for the 30 integers from 30 (seg_base + i), of which
+ * only the eight coprime to 30 can be prime, one bit each. Memory is
+ * the sieving primes up to sqrt(stop), which any number of sieves may
+ * share read-only, plus a segment per sieve, whatever the range.
+ *
+ *   sieve_small_primes(sieve_isqrt(hi - 1), &primes, &n);
+ *   sieve_init(&s, primes, n, sieve_segment_bytes(...));
+ *   sieve_range(&s, lo, hi);
+ *   while (sieve_segment(&s))
+ *     count += sieve_count(&s);
+ *
+ * 2, 3 and 5 are off the wheel and never reported.
+ *
+ * The wheel tables are exported for other sieves over the same layout;
+ * sieve_tables_init() fills them, once, and sieve_init() calls it.
+ */
+#define SIEVE_MIN_BYTES ((size_t)32 << 10)
+#define SIEVE_MAX_BYTES ((size_t)256 << 10)
+
+/* Multiples of 7, 11 and 13 repeat every 7 * 11 * 13 bytes; segments
+ * start from a copy of that pattern and sieve from 17 up. */
+#define SIEVE_PRESIEVE_BYTES 1001
+#define SIEVE_FIRST_PRIME 17
+
+/* Crossing off p * m moves on to the next m coprime to 30: the byte
+ * advances by dq * (p / 30) + dc and the wheel index to next. There is
+ * one step for each residue of p and of m, 64 in all. */
+typedef struct SieveStep_s {
+  uint8_t clear;
+  uint8_t dq;
+  uint8_t dc;
+  uint8_t next;
+} SieveStep;
+
+typedef struct PrimeSieve_s {
+  uint64_t lo;         /* next number to sieve */
+  uint64_t hi;         /* end of the range, exclusive */
+  uint64_t seg_base;   /* first byte of the current segment, in 30s */
+  size_t seg_bytes;
+  size_t max_bytes;
+  uint8_t *bytes;      /* set bit: prime */
+  uint32_t const *primes; /* sieving primes from 17, ascending */
+  uint64_t *offs;      /* byte offset of each prime's next multiple */
+  uint8_t *wheel;      /* and its wheel index */
+  size_t n_primes;
+  size_t active;       /* primes whose square has been reached */
+} PrimeSieve;
+
+extern uint8_t const sieve_residues[8];
+extern int8_t sieve_class[30];           /* bit of residue r, or -1 */
+extern uint8_t sieve_gap[30];            /* from r to the next residue */
+extern uint8_t sieve_upto[30];           /* bits of the residues <= r */
+extern SieveStep sieve_steps[64];
+extern uint8_t sieve_presieve[SIEVE_PRESIEVE_BYTES];
+
+void sieve_tables_init(void);
+
+uint64_t sieve_isqrt(uint64_t n);
+
+/* Odd primes up to limit, which is at most 2^32, into a new array.
+ * Returns -1 if out of memory. */
+int sieve_small_primes(uint64_t limit, uint32_t **out, size_t *n_out);
+
+/* Segment size for sieving primes up to root. */
+size_t sieve_segment_bytes(uint64_t root);
+
+/* Byte offset from base, and wheel index, of the first multiple p * m
+ * with m coprime to 30 that is at least max(p * p, 30 base). */
+uint64_t sieve_first_multiple(uint64_t p, uint64_t base, uint8_t *wheel);
+
+/* A sieve over the odd primes up to sqrt of the highest number it will
+ * see, as from sieve_small_primes(); those below SIEVE_FIRST_PRIME are
+ * skipped. Returns -1 if out of memory. */
+int sieve_init(PrimeSieve *s, uint32_t const *primes, size_t n_primes, size_t bytes);
+void sieve_free(PrimeSieve *s);
+
+/* Restarts the sieve on the primes from 7 up in [lo, hi). */
+void sieve_range(PrimeSieve *s, uint64_t lo, uint64_t hi);
+
+/* Sieves the next segment; false once the range is done. */
+bool sieve_segment(PrimeSieve *s);
+
+/* Primes in the current segment. */
+uint64_t sieve_count(PrimeSieve const *s);
+
+/* The 8 bytes from at, as one word for popcounts. */
+static inline uint64_t
+sieve_word (uint8_t const *bytes, size_t at)
+{
+  uint64_t w;
+
+  memcpy(&w, bytes + at, 8);
+  return w;
+}
+
+/*
+ * Helpers for the threaded users of the sieve. sieve_threads() turns 0
+ * into the number of online CPUs and caps the count at
+ * SIEVE_MAX_THREADS. sieve_run() calls fn on n_threads threads, this
+ * one among them, passing thread t the address arg + t * stride, and
+ * returns once all are done. A thread that cannot be started leaves
+ * its share to the others; it returns how many ran, at least one.
+ */
+#define SIEVE_MAX_THREADS 1024
+
+unsigned sieve_threads(unsigned n_threads);
+unsigned sieve_run(int (*fn)(void *), void *arg, size_t stride, unsigned n_threads);
+
+#endif /* !defined(__sieve_h__) */